@@ -22,9 +22,38 @@
 #include <linux/version.h>
 #include <linux/nmi.h>
 #include <linux/kallsyms.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kexec.h>
+#include <linux/err.h>
+#include <linux/cpumask.h>
+#include <linux/stacktrace.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/irqflags.h>
+#include <linux/hardirq.h>
+#include <linux/hrtimer.h>
+#include <linux/bitops.h>
+#include <linux/delay.h>
+#include <linux/tracepoint.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/cpu.h>
+#include <linux/jhash.h>
+#include <linux/perf_event.h>
+#include <linux/miscdevice.h>
+#include <linux/configfs.h>
+#include <linux/fs.h>
+#include <linux/rcupdate.h>
+#include <linux/capability.h>
+#include <linux/timex.h>
+#include <linux/kprobes.h>
 
 #include <asm/nmi.h>
 #include <asm/x86_init.h>
+#include <asm/apic.h>
 
 /* Compatibility management */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 2, 0)
@@ -36,26 +65,315 @@
 /* HANDLED=1, OK=1, DONE=0  */
 #define NMI_HANDLED NOTIFY_OK
 #define NMI_DONE    NOTIFY_DONE
+
+/* Types as of 3.5, to report the same values */
+enum {
+	NMI_LOCAL=0,
+	NMI_UNKNOWN,
+	NMI_SERR,
+	NMI_IO_CHECK,
+	NMI_MAX
+};
+#endif
+
+#include <asm/mach_traps.h>
+#include <linux/io.h>
+
+/* Before 2.6.38 */
+#ifndef NMI_REASON_PORT
+#define NMI_REASON_PORT        0x61
+#define NMI_REASON_SERR        0x80
+#define NMI_REASON_IOCHK       0x40
+#define NMI_REASON_CLEAR_SERR  0x04
+#define NMI_REASON_CLEAR_IOCHK 0x08
+#define NMI_REASON_CLEAR_MASK  0x0f
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/clock.h>
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 37)
+#define local_clock() sched_clock()
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+#define cpus_read_lock()    get_online_cpus()
+#define cpus_read_unlock()  put_online_cpus()
+#endif
+
+/* Before 3.19 */
+#ifndef READ_ONCE
+#define READ_ONCE(x)        ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)  (ACCESS_ONCE(x) = (val))
+#endif
+
+/* Before 2.6.38 */
+#ifndef pr_warn
+#define pr_warn pr_warning
+#endif
+#ifndef RCU_INIT_POINTER
+#define RCU_INIT_POINTER(p, v)  rcu_assign_pointer(p, v)
+#endif
+
+/* Before 2.6.37 */
+#ifndef __rcu
+#define __rcu
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)
+#define noop_llseek no_llseek
+#endif
+
+/* Before 2.6.34: the update side holds nmimgr_policy_lock */
+#ifndef rcu_dereference_protected
+#define rcu_dereference_protected(p, c)  (p)
+#endif
+
+/*
+ * Before 2.6.33. Static and dynamic per-cpu data share the per_cpu_ptr()
+ * offsets since 2.6.30. Not atomic against interrupts: the counters are
+ * only written by the NMI handler of their CPU
+ */
+#ifndef __percpu
+#define __percpu
+#endif
+#ifndef this_cpu_ptr
+#define this_cpu_ptr(ptr)         per_cpu_ptr(ptr, raw_smp_processor_id())
+#define this_cpu_read(pcp)        (*this_cpu_ptr(&(pcp)))
+#define this_cpu_write(pcp, val)  (*this_cpu_ptr(&(pcp)) = (val))
+#define this_cpu_add(pcp, val)    (*this_cpu_ptr(&(pcp)) += (val))
+#define this_cpu_inc(pcp)         this_cpu_add(pcp, 1)
+#endif
+
+#include "nmimgr.h"
+#include "nmimgr_policy.h"
+#ifdef NMIMGR_BAKED
+/* Generated by "nmimgrctl bake", see the top Makefile */
+#include "nmimgr_baked.h"
+#endif
 
 #define NMIMGR_VERSION  "0.4"
-#define NMIMGR_NAME     "nmimgr"
-#define NMIMGR_NBMAX    256
 
+static const char *nmimgr_opnames[OP_MAX] = {
+	"ignore", "drop", "debug", "panic", "escalate"
+};
+
+/* The kernel waits 2s for IOCHK to settle, but it also reports the error */
+#define NMIMGR_IOCHK_SETTLE_US  100
+/* Same SERR/IOCHK event dropped again that soon: the latch re-fired */
+#define NMIMGR_REFIRE_NS        (1 * NSEC_PER_MSEC)
+
+/* Debug action, degraded when over budget_us for budget_strikes times */
 enum {
-	OP_IGNORE=0,
-	OP_DROP,
-	OP_DEBUG,
-	OP_PANIC
+	NMIMGR_DEBUG_FULL=0,    /* dump_stack + show_regs */
+	NMIMGR_DEBUG_RAW,       /* Stack saved in the per-cpu buffer */
+	NMIMGR_DEBUG_COUNT,     /* Counters only */
+	NMIMGR_DEBUG_MAX
+};
+
+static const char *nmimgr_debugnames[NMIMGR_DEBUG_MAX] = {
+	"full", "raw", "count"
 };
 
+/*
+ * Same burst of NMIs (eg, broadcasted to all CPUs) for the escalation. The
+ * window must be longer, or the second NMI could never panic
+ */
+#define NMIMGR_ESCALATE_HOLDOFF_MS  1000
+#define NMIMGR_ESCALATE_HOLDOFF_NS  \
+	((u64)NMIMGR_ESCALATE_HOLDOFF_MS * NSEC_PER_MSEC)
+#define NMIMGR_ESCALATE_WINDOW      60000
+
+
+/*
+ * Live policy, and the shadow one only counted: both are looked up at once
+ * and replaced together. gen changes with the live one, and is recorded with
+ * the events it classified
+ */
+struct nmimgr_policies {
+	struct nmimgr_policy live;
+	struct nmimgr_policy shadow;
+	bool has_shadow;
+	u32 gen;
+};
 
-static int   events_arr[4][NMIMGR_NBMAX];
+/*
+ * Policy from the parameters, until one is uploaded to /dev/nmimgr. When
+ * baked, the decided actions are fixed at build time
+ */
+static struct nmimgr_policies nmimgr_policy = {
+	.live = {
+		.magic   = NMIMGR_POLICY_MAGIC,
+		.version = NMIMGR_POLICY_VERSION,
+#ifdef NMIMGR_BAKED
+		.act     = NMIMGR_BAKED_ACT,
+#endif
+	},
+};
+static struct nmimgr_policies __rcu *nmimgr_live;
+static DEFINE_MUTEX(nmimgr_policy_lock);
+static struct nmimgr_policy nmimgr_unclaimed;
+#ifndef NMIMGR_BAKED
 static char *events_ignore;
 static char *events_debug;
 static char *events_drop;
 static char *events_panic;
+static char *events_escalate;
+#endif
+static unsigned int escalate_window = NMIMGR_ESCALATE_WINDOW;
+static bool test_mode;
+static bool profile_handlers;
+static char *drop_mode;
+static unsigned int budget_us;
+static unsigned int budget_strikes = 3;
+static bool catch_unclaimed;
+static char *unclaimed_drop;
+static char *unclaimed_debug;
+static char *unclaimed_panic;
+static char *events_sample;
+static bool selftest;
+static bool nmimgr_drop_ack;
+
+/* Record 1 in nmimgr_sample[reason] events, counted per CPU */
+static u16 nmimgr_sample[NMIMGR_NBMAX];
+struct nmimgr_sample_cpu {
+	u16 n[NMIMGR_NBMAX];
+};
+static struct nmimgr_sample_cpu __percpu *nmimgr_sample_cpu;
+
+/* Debug level of each event, and its consecutive runs over budget */
+static u8 nmimgr_degrade[NMIMGR_NBMAX];
+static atomic_t nmimgr_strikes[NMIMGR_NBMAX];
+
+/* When each event was armed for escalation, 0 if not */
+static u64 nmimgr_armed[NMIMGR_NBMAX];
+static struct cpumask nmimgr_bt_mask;
+
+/* Allocated on the CPU node while it is online, NULL otherwise */
+static unsigned int ring_size = NMIMGR_RING_SIZE;
+static unsigned int nmimgr_ring_mask;
+static DEFINE_PER_CPU(struct nmimgr_ring *, nmimgr_ring);
+static DEFINE_PER_CPU(struct nmimgr_bt *, nmimgr_bt);
+
+/*
+ * Allocated at load, as the large per-cpu tables: the static per-cpu area
+ * of modules is only a few KB, shared by all of them
+ */
+static struct nmimgr_stats __percpu *nmimgr_stats;
+
+/* Distinct debug stacks, never freed. Slots past the probe are not tried */
+#define NMIMGR_DEPOT_PROBE  16
+static struct nmimgr_stack nmimgr_depot[NMIMGR_DEPOT_SIZE];
+/* Depot handle of the stack taken by this NMI, for its event record */
+static DEFINE_PER_CPU(u32, nmimgr_stack_cur);
+/* Generation of the policy that classified this NMI, same */
+static DEFINE_PER_CPU(u16, nmimgr_gen_cur);
+
+/* Weight of a new gap in the mean: 1/8 */
+#define NMIMGR_EWMA_SHIFT   3
+/* Gaps histogram, in powers of 4 from 1us */
+#define NMIMGR_GAP_BUCKETS  16
+
+/**
+ * Rate estimator of each reason on a CPU: mean gap between two NMIs as an
+ * EWMA, and their distribution. Integer only, updated by the handler
+ */
+struct nmimgr_rate {
+	u64 last[NMIMGR_NBMAX];         /* local_clock() of the last NMI */
+	u64 avg[NMIMGR_NBMAX];          /* Mean gap in ns, 0 until 2 NMIs */
+	u32 gaps[NMIMGR_NBMAX][NMIMGR_GAP_BUCKETS];
+};
+static DEFINE_PER_CPU(struct nmimgr_rate *, nmimgr_rate);
+
+/* First stage of a NMI we let pass, checked by the terminal handler */
+struct nmimgr_pending {
+	u64  seq;       /* Ring record of the first stage, ~0 if none */
+	int  claims;    /* By the handlers after us */
+	u8   type;
+	u8   reason;
+	bool armed;
+};
+static DEFINE_PER_CPU(struct nmimgr_pending, nmimgr_pending);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 2, 0)
+static bool nmimgr_catch;   /* Terminal handler registered */
+#endif
+
+static struct nmimgr_crashinfo nmimgr_crashinfo;
+static struct dentry *nmimgr_debugfs;
+
+/* Result of the last write to debugfs "inject" */
+static DEFINE_MUTEX(nmimgr_inject_lock);
+static struct {
+	unsigned int type, reason, count, handled;
+	u64 min, max, total;
+} nmimgr_inject_res;
+
+/* log2(ns) buckets */
+#define NMIMGR_HIST_BUCKETS 32
+
+/* Per-cpu accounting of the NMIs sent by debugfs "storm" */
+struct nmimgr_storm_cpu {
+	u64 sent;
+	u64 recv;
+	u64 send_ts;
+	u32 lat[NMIMGR_HIST_BUCKETS];   /* From send to our handler */
+	u32 dur[NMIMGR_HIST_BUCKETS];   /* Time in __nmimgr_handle */
+};
+static DEFINE_PER_CPU(struct nmimgr_storm_cpu, nmimgr_storm_cpu);
+
+/* NMIs still in flight when the storm ends are waited for that long */
+#define NMIMGR_STORM_GRACE_NS  (10 * NSEC_PER_MSEC)
+/* Fastest rate: the APIC and handler cost make it moot to go further */
+#define NMIMGR_STORM_MIN_PERIOD_NS  10000
+
+static DEFINE_MUTEX(nmimgr_storm_lock);
+static struct {
+	struct hrtimer timer;
+	struct cpumask mask;
+	u64 period, start, end;
+	unsigned int rate;
+	bool active;    /* Our handler claims the NMIs it was sent */
+	bool stopping;
+} nmimgr_storm;
+
+
+/*
+ * Lookup of the kernel symbols not exported to modules. kallsyms_lookup_name
+ * is exported from 2.6.33 to 5.6. From 5.7, a kprobe gives its address, but
+ * only without IBT: it would be an indirect call to a sealed function
+ */
+#if defined(MODULE) && defined(CONFIG_KALLSYMS) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 33)
+static unsigned long (*nmimgr_kallsyms_lookup)(const char *name);
+
+static void __init nmimgr_lookup_init(void)
+{
+#  if LINUX_VERSION_CODE < KERNEL_VERSION(5, 7, 0)
+	nmimgr_kallsyms_lookup = kallsyms_lookup_name;
+#  elif defined(CONFIG_KPROBES) && !defined(CONFIG_X86_KERNEL_IBT)
+	struct kprobe kp = { .symbol_name = "kallsyms_lookup_name" };
+
+	if (!register_kprobe(&kp)) {
+		nmimgr_kallsyms_lookup = (void *)kp.addr;
+		unregister_kprobe(&kp);
+	}
+#  endif
+	if (!nmimgr_kallsyms_lookup)
+		pr_warn(NMIMGR_NAME": No kernel symbols lookup: no registers "
+			"in debug, no vmcoreinfo entry\n");
+}
+
+/* Resolved at init, can then be used in NMI context */
+static unsigned long nmimgr_lookup_name(const char *name)
+{
+	return nmimgr_kallsyms_lookup ? nmimgr_kallsyms_lookup(name) : 0;
+}
+#else
+static inline void nmimgr_lookup_init(void) { }
+static inline unsigned long nmimgr_lookup_name(const char *name)
+{
+	return 0;
+}
+#endif
 
 
 static void __nmimgr_trace(struct pt_regs *regs) {
@@ -66,15 +384,11 @@ static void __nmimgr_trace(struct pt_regs *regs) {
 
 	/* show_regs is not exported */
 #ifdef MODULE
-#  ifdef CONFIG_KALLSYMS
-#    if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 33)
 	/* Try to find show_regs */
-	sym_show_regs = (void*)kallsyms_lookup_name("show_regs");
+	sym_show_regs = (void*)nmimgr_lookup_name("show_regs");
 	if (sym_show_regs)
 		sym_show_regs(regs);
 
-#    endif
-#  endif /* CONFIG_KALLSYMS */
 #else  /* MODULE */
 	show_regs(regs);
 #endif
@@ -82,272 +396,3311 @@ static void __nmimgr_trace(struct pt_regs *regs) {
 }
 
 
+static unsigned int __nmimgr_save_stack(unsigned long *entries)
+{
+	unsigned int nr = 0;
+
+#ifdef CONFIG_STACKTRACE
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	nr = stack_trace_save(entries, NMIMGR_BT_DEPTH, 0);
+#  else
+	struct stack_trace trace = {
+		.entries     = entries,
+		.max_entries = NMIMGR_BT_DEPTH,
+	};
+	save_stack_trace(&trace);
+	nr = trace.nr_entries;
+#  endif
+#endif /* CONFIG_STACKTRACE */
+
+	return nr;
+}
+
+/**
+ * Snapshot of the interrupted context into this CPU preallocated buffer
+ */
+static void __nmimgr_capture(struct pt_regs *regs)
+{
+	struct nmimgr_bt *bt = this_cpu_read(nmimgr_bt);
+	unsigned long entries[NMIMGR_BT_DEPTH];
+	unsigned int i, nr;
+
+	if (!bt)
+		return;
+
+	nr = __nmimgr_save_stack(entries);
+	for (i = 0; i < nr; i++)
+		bt->entries[i] = entries[i];
+	bt->nr  = nr;
+	bt->ip  = regs ? instruction_pointer(regs) : 0;
+	bt->pid = current->pid;
+	memcpy(bt->comm, current->comm, sizeof(bt->comm));
+	barrier();
+	bt->ts  = local_clock();
+}
+
+/**
+ * Find or add a stack in the depot, lock-free: a free slot is claimed with
+ * cmpxchg and only matched once its nr is set. Returns the handle, or 0 if
+ * no slot is left in the probe window.
+ */
+static u32 __nmimgr_depot_save(unsigned long *entries, unsigned int nr,
+			bool *new)
+{
+	struct nmimgr_stack *st;
+	unsigned int i, j, n;
+	u32 hash, idx;
+
+	hash = jhash2((u32 *)entries, nr * sizeof(*entries) / sizeof(u32), 0);
+
+	for (i = 0; i < NMIMGR_DEPOT_PROBE; i++) {
+		idx = (hash + i) & (NMIMGR_DEPOT_SIZE - 1);
+		st = &nmimgr_depot[idx];
+		n = READ_ONCE(st->nr);
+
+		if (n == 0) {
+			if (cmpxchg(&st->nr, 0, NMIMGR_STACK_BUSY) != 0)
+				continue;
+
+			st->hash = hash;
+			st->ts   = local_clock();
+			for (j = 0; j < nr; j++)
+				st->entries[j] = entries[j];
+			/* Same layout as atomic64_t */
+			atomic64_set((atomic64_t *)&st->hits, 1);
+			smp_wmb();
+			WRITE_ONCE(st->nr, nr);
+			*new = true;
+			return idx + 1;
+		}
+
+		if (n != nr || READ_ONCE(st->hash) != hash)
+			continue;
+
+		smp_rmb();
+		for (j = 0; j < nr; j++) {
+			if (st->entries[j] != entries[j])
+				break;
+		}
+		if (j == nr) {
+			atomic64_inc((atomic64_t *)&st->hits);
+			*new = false;
+			return idx + 1;
+		}
+	}
+
+	this_cpu_inc(nmimgr_stats->depot_full);
+	return 0;
+}
+
+/**
+ * Store the current stack in the depot, for the event record
+ */
+static u32 __nmimgr_depot_capture(bool *new)
+{
+	unsigned long entries[NMIMGR_BT_DEPTH];
+	unsigned int nr = __nmimgr_save_stack(entries);
+	u32 handle;
+
+	*new = true;
+	if (!nr)
+		return 0;
+
+	handle = __nmimgr_depot_save(entries, nr, new);
+	this_cpu_write(nmimgr_stack_cur, handle);
+	return handle;
+}
+
+
+/**
+ * NMI IPI to the CPUs in mask, as trigger_all_cpu_backtrace() does
+ */
+static void __nmimgr_send_nmi(const struct cpumask *mask)
+{
+	apic->send_IPI_mask(mask, NMI_VECTOR);
+}
+
+/**
+ * Capture this CPU, and ask the other ones to capture themselves
+ */
+static void __nmimgr_capture_all(struct pt_regs *regs)
+{
+	int cpu = smp_processor_id();
+
+	__nmimgr_capture(regs);
+
+	cpumask_copy(&nmimgr_bt_mask, cpu_online_mask);
+	cpumask_clear_cpu(cpu, &nmimgr_bt_mask);
+	if (!cpumask_empty(&nmimgr_bt_mask))
+		__nmimgr_send_nmi(&nmimgr_bt_mask);
+}
+
+/**
+ * Reply to the NMI IPI of __nmimgr_capture_all. Only claim it if it is ours
+ */
+static int __nmimgr_bt_handle(struct pt_regs *regs)
+{
+	int cpu = smp_processor_id();
+
+	if (!cpumask_test_cpu(cpu, &nmimgr_bt_mask))
+		return NMI_DONE;
+
+	__nmimgr_capture(regs);
+	cpumask_clear_cpu(cpu, &nmimgr_bt_mask);
+	return NMI_HANDLED;
+}
+
+/**
+ * Staged escalation: the first NMI captures all CPUs, a second one for the
+ * same event within escalate_window ms asks for the panic.
+ * Returns 0 when armed, 1 if we should panic, -1 if already armed by the
+ * same burst of NMIs
+ */
+static int __nmimgr_escalate(unsigned char reason, struct pt_regs *regs)
+{
+	u64 now = local_clock();
+	u64 armed = READ_ONCE(nmimgr_armed[reason]);
+	u64 window = (u64)READ_ONCE(escalate_window) * NSEC_PER_MSEC;
+
+	if (armed && now - armed < window) {
+		/* Still the same NMI, seen by another CPU */
+		if (now - armed < NMIMGR_ESCALATE_HOLDOFF_NS)
+			return -1;
+		return 1;
+	}
+
+	/* Another CPU just armed it */
+	if (cmpxchg64(&nmimgr_armed[reason], armed, now) != armed)
+		return -1;
+
+	__nmimgr_capture_all(regs);
+	return 0;
+}
+
+
+/**
+ * Where the NMI hit, from regs and current: cheap enough for every recorded
+ * event, unlike the debug stack
+ */
+static inline void __nmimgr_context(struct nmimgr_event *ev,
+			struct pt_regs *regs)
+{
+	unsigned int pc = preempt_count();
+	u32 ctx = 0;
+
+	/* Injected NMIs are not in NMI context */
+	if (in_nmi())
+		pc -= NMI_OFFSET + HARDIRQ_OFFSET;
+	if (regs && user_mode(regs))
+		ctx |= NMIMGR_CTX_USER;
+	if (regs && arch_irqs_disabled_flags(regs->flags))
+		ctx |= NMIMGR_CTX_IRQOFF;
+
+	ev->ip      = regs ? instruction_pointer(regs) : 0;
+	ev->pid     = current->pid;
+	ev->preempt = pc;
+	ev->ctx     = ctx;
+	memcpy(ev->comm, current->comm, sizeof(ev->comm));
+}
+
+/**
+ * Store the decision in this CPU ring. NMIs do not nest, so we are the only
+ * writer here; readers check the seq to detect an overwritten slot.
+ * Sampled events are only counted, and an event identical to the previous
+ * record is merged in it, with the context of the last one. The exact
+ * counts are in nmimgr_stats.
+ */
+static void __nmimgr_record_ev(unsigned int type, unsigned char reason,
+			unsigned char ops, unsigned char flags, u32 ref,
+			struct pt_regs *regs)
+{
+	struct nmimgr_ring *ring = this_cpu_read(nmimgr_ring);
+	struct nmimgr_event *ev;
+	u64 head, now;
+	unsigned int rate = READ_ONCE(nmimgr_sample[reason]);
+	u32 stack = this_cpu_read(nmimgr_stack_cur);
+	u16 gen = this_cpu_read(nmimgr_gen_cur);
+	u32 count = 1;
+
+	this_cpu_write(nmimgr_stack_cur, 0);
+	if (!ring) {
+		this_cpu_write(nmimgr_pending.seq, ~0ULL);
+		return;
+	}
+	head = ring->head;
+	now = local_clock();
+
+	/* Panics and escalations are always kept */
+	if (rate > 1 && !(ops & (1 << OP_PANIC | 1 << OP_ESCALATE))) {
+		u16 *n = &this_cpu_ptr(nmimgr_sample_cpu)->n[reason];
+
+		if ((*n)++) {
+			if (*n >= rate)
+				*n = 0;
+			this_cpu_inc(nmimgr_stats->sampled);
+			this_cpu_write(nmimgr_pending.seq, ~0ULL);
+			return;
+		}
+		count = rate;
+	}
+
+	if (head) {
+		ev = &ring->ev[(head - 1) & nmimgr_ring_mask];
+		if (ev->type == type && ev->reason == reason && ev->ops == ops &&
+		    ev->flags == flags && ev->ref == ref && ev->stack == stack &&
+		    ev->gen == gen && ev->count <= ~0U - count) {
+			ev->last = now;
+			ev->count += count;
+			__nmimgr_context(ev, regs);
+			this_cpu_inc(nmimgr_stats->coalesced);
+			this_cpu_write(nmimgr_pending.seq, ev->seq);
+			return;
+		}
+	}
+
+	ev = &ring->ev[head & nmimgr_ring_mask];
+	ev->ts     = now;
+	ev->last   = now;
+	ev->seq    = (u32)head;
+	ev->count  = count;
+	ev->cpu    = smp_processor_id();
+	ev->type   = type;
+	ev->reason = reason;
+	ev->ops    = ops;
+	ev->flags  = flags;
+	ev->ref    = ref;
+	ev->stack  = stack;
+	ev->gen    = gen;
+	__nmimgr_context(ev, regs);
+
+	barrier();
+	ring->head = head + 1;
+	this_cpu_write(nmimgr_pending.seq, head);
+}
+
+static inline void __nmimgr_record(unsigned int type, unsigned char reason,
+			unsigned char ops, struct pt_regs *regs)
+{
+	__nmimgr_record_ev(type, reason, ops, 0, ~0U, regs);
+}
+
+
+/**
+ * Debug action, within budget_us. Each time it runs over budget_strikes
+ * times in a row, it is degraded to the next cheaper level
+ */
+static void __nmimgr_debug(unsigned char reason, struct pt_regs *regs)
+{
+	unsigned int level = READ_ONCE(nmimgr_degrade[reason]);
+	u64 budget = (u64)READ_ONCE(budget_us) * NSEC_PER_USEC;
+	u64 start = local_clock();
+	bool new;
+	u32 handle;
+
+	switch (level) {
+	case NMIMGR_DEBUG_FULL:
+		/* Only dump a stack the first time we see it */
+		handle = __nmimgr_depot_capture(&new);
+		if (!new) {
+			pr_notice(NMIMGR_NAME": Debug NMI, same stack #%u "
+				"(%llu hits)\n", handle,
+				nmimgr_depot[handle - 1].hits);
+			break;
+		}
+		if (handle)
+			pr_notice(NMIMGR_NAME": Debug NMI, stack #%u\n", handle);
+		else
+			pr_notice(NMIMGR_NAME": Debug NMI");
+		__nmimgr_trace(regs);
+		break;
+	case NMIMGR_DEBUG_RAW:
+		__nmimgr_depot_capture(&new);
+		break;
+	default:
+		return;
+	}
+
+	if (!budget)
+		return;
+
+	if (local_clock() - start <= budget) {
+		atomic_set(&nmimgr_strikes[reason], 0);
+		return;
+	}
+
+	this_cpu_inc(nmimgr_stats->overbudget);
+	if (atomic_inc_return(&nmimgr_strikes[reason]) < READ_ONCE(budget_strikes))
+		return;
+
+	atomic_set(&nmimgr_strikes[reason], 0);
+	if (cmpxchg(&nmimgr_degrade[reason], level, level + 1) == level) {
+		this_cpu_inc(nmimgr_stats->degraded);
+		pr_warn(NMIMGR_NAME": Debug of event 0x%02x over %uus, "
+			"degraded to %s\n", reason, budget_us,
+			nmimgr_debugnames[level + 1]);
+	}
+}
+
+static unsigned char __nmimgr_read_reason(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
+	return x86_platform.get_nmi_reason();
+#else
+	return inb(NMI_REASON_PORT);
+#endif
+}
+
+/**
+ * When we claim a SERR/IOCHK NMI, the kernel does not clear the latch.
+ * Do it like pci_serr_error() and io_check_error(), but re-enable the line
+ * right after. Only on the SERR/IOCHK paths of 3.2+, where the kernel holds
+ * the reason port lock (drop_mode=ack is refused before), and if still
+ * latched. Never for an injected NMI: nothing holds the lock there
+ */
+static void __nmimgr_ack(unsigned int type, unsigned char reason)
+{
+	unsigned char port, cur;
+
+	if (type != NMI_SERR && type != NMI_IO_CHECK)
+		return;
+	if (!in_nmi())
+		return;
+
+	port = __nmimgr_read_reason();
+
+	if (reason & port & NMI_REASON_SERR) {
+		cur = (port & NMI_REASON_CLEAR_MASK) | NMI_REASON_CLEAR_SERR;
+		outb(cur, NMI_REASON_PORT);
+		cur &= ~NMI_REASON_CLEAR_SERR;
+		outb(cur, NMI_REASON_PORT);
+		this_cpu_inc(nmimgr_stats->ack_serr);
+	}
+
+	if (reason & port & NMI_REASON_IOCHK) {
+		cur = (port & NMI_REASON_CLEAR_MASK) | NMI_REASON_CLEAR_IOCHK;
+		outb(cur, NMI_REASON_PORT);
+		udelay(NMIMGR_IOCHK_SETTLE_US);
+		cur &= ~NMI_REASON_CLEAR_IOCHK;
+		outb(cur, NMI_REASON_PORT);
+		this_cpu_inc(nmimgr_stats->ack_iochk);
+	}
+}
+
+/**
+ * Panic, or only count it when testing (test_mode when the NMI came, or the
+ * test run started). Returns if the panic did not happen
+ */
+static int __nmimgr_do_panic(struct pt_regs *regs, bool test)
+{
+	if (test) {
+		this_cpu_inc(nmimgr_stats->test_panic);
+		return NMI_HANDLED;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	nmi_panic(regs, NMIMGR_NAME": Hit explicit panic");
+#else
+	panic(NMIMGR_NAME": Hit explicit panic");
+#endif
+	return NMI_HANDLED;
+}
+
+static int __nmimgr_panic(unsigned int type, unsigned char reason,
+			unsigned char ops, struct pt_regs *regs, bool test)
+{
+	pr_emerg(NMIMGR_NAME": Panic on Event:0x%02x(%d)\n", reason, reason);
+	this_cpu_inc(nmimgr_stats->ops[OP_PANIC]);
+	__nmimgr_record(type, reason, ops | 1 << OP_PANIC, regs);
+
+	return __nmimgr_do_panic(regs, test);
+}
+
+#ifdef NMIMGR_BAKED
+/**
+ * Actions of the baked policy, already decided. It never changes: no RCU,
+ * no shadow
+ */
+static inline unsigned char __nmimgr_act(unsigned int type,
+			unsigned char reason)
+{
+	if (type >= NMIMGR_NTYPES)
+		return 0;
+	return nmimgr_policy.live.act[type][reason];
+}
+
+#define __nmimgr_decide(type, reason)  __nmimgr_act(type, reason)
+
+/* Only the paths of the ops in the baked policy are built */
+#define __nmimgr_has(act, op) \
+	((NMIMGR_BAKED_OPS & (1 << (op))) && ((act) & (1 << (op))))
+
+#else
+/**
+ * Count what the shadow policy would have done, and whether it differs
+ * from the live one, both as decided by the handler
+ */
+static void __nmimgr_shadow(unsigned char shadow, unsigned char act,
+			unsigned char reason)
+{
+	int op;
+
+	shadow = nmimgr_policy_decide(shadow);
+	act = nmimgr_policy_decide(act);
+
+	for (op = 0; op < OP_MAX; op++) {
+		if (shadow & (1 << op)) {
+			this_cpu_inc(nmimgr_stats->shadow_ops[op]);
+			this_cpu_inc(nmimgr_stats->shadow_reason[reason][op]);
+		}
+	}
+
+	if (shadow != act)
+		this_cpu_inc(nmimgr_stats->shadow_diff[reason]);
+}
+
+/**
+ * Actions of the live policy. NMIs are RCU readers, so an uploaded policy
+ * is only freed once no handler can still use it
+ */
+static inline unsigned char __nmimgr_act(unsigned int type,
+			unsigned char reason)
+{
+	struct nmimgr_policies *pol;
+	unsigned char act;
+
+	if (type >= NMIMGR_NTYPES)
+		return 0;
+
+	rcu_read_lock();
+	pol = rcu_dereference(nmimgr_live);
+	act = pol->live.act[type][reason];
+	this_cpu_write(nmimgr_gen_cur, (u16)pol->gen);
+	if (unlikely(pol->has_shadow))
+		__nmimgr_shadow(pol->shadow.act[type][reason], act, reason);
+	rcu_read_unlock();
+
+	return act;
+}
+
+#define __nmimgr_decide(type, reason) \
+	nmimgr_policy_decide(__nmimgr_act(type, reason))
+
+#define __nmimgr_has(act, op)  ((act) & (1 << (op)))
+#endif
+
+
+static inline int __nmimgr_gap_idx(u64 ns)
+{
+	int i = (fls64(ns >> 10) + 1) / 2;
+
+	return i < NMIMGR_GAP_BUCKETS ? i : NMIMGR_GAP_BUCKETS - 1;
+}
+
+/**
+ * Account the NMI in the estimator of its reason. Returns the gap since the
+ * previous one on this CPU, ~0 if none
+ */
+static u64 __nmimgr_rate(unsigned char reason, u64 now)
+{
+	struct nmimgr_rate *rate = this_cpu_read(nmimgr_rate);
+	u64 last, gap, avg;
+
+	if (!rate)
+		return ~0ULL;
+
+	last = rate->last[reason];
+	rate->last[reason] = now;
+	if (!last)
+		return ~0ULL;
+
+	gap = now - last;
+	avg = rate->avg[reason];
+	rate->avg[reason] = avg ? avg - (avg >> NMIMGR_EWMA_SHIFT) +
+		(gap >> NMIMGR_EWMA_SHIFT) : gap;
+	rate->gaps[reason][__nmimgr_gap_idx(gap)]++;
+	return gap;
+}
+
+/**
+ * Handler. test: the panics are only counted
+ */
+static int __nmimgr_handle(unsigned int type, unsigned char reason,
+			struct pt_regs *regs, bool test)
+{
+	unsigned char act = __nmimgr_decide(type, reason);
+	unsigned char ops = 0;
+	u64 gap;
+	int ret;
+
+	this_cpu_inc(nmimgr_stats->seen);
+	this_cpu_inc(nmimgr_stats->reason[reason]);
+	gap = __nmimgr_rate(reason, local_clock());
+
+	/* ignored NMI */
+	if (__nmimgr_has(act, OP_IGNORE)) {
+		this_cpu_inc(nmimgr_stats->ops[OP_IGNORE]);
+		return NMI_DONE;
+	}
+
+
+	pr_notice(NMIMGR_NAME": Handling new NMI type:%u event:0x%02x (%d)\n",
+		type, reason, reason);
+
+	/* Debugging NMI */
+	if (__nmimgr_has(act, OP_DEBUG)) {
+		this_cpu_inc(nmimgr_stats->ops[OP_DEBUG]);
+		ops |= 1 << OP_DEBUG;
+		__nmimgr_debug(reason, regs);
+	}
+
+
+	/* dropped NMI */
+	if (__nmimgr_has(act, OP_DROP)) {
+		pr_notice(NMIMGR_NAME": Drop NMI event:0x%02x (%d)\n",
+			reason, reason);
+		this_cpu_inc(nmimgr_stats->ops[OP_DROP]);
+		__nmimgr_record(type, reason, ops | 1 << OP_DROP, regs);
+
+		if (reason & (NMI_REASON_SERR | NMI_REASON_IOCHK)) {
+			if (gap < NMIMGR_REFIRE_NS)
+				this_cpu_inc(nmimgr_stats->refire);
+
+			if (nmimgr_drop_ack)
+				__nmimgr_ack(type, reason);
+		}
+		return NMI_HANDLED;
+	}
+
+	/* Staged panic NMI */
+	if (__nmimgr_has(act, OP_ESCALATE)) {
+		ret = __nmimgr_escalate(reason, regs);
+		if (ret > 0)
+			return __nmimgr_panic(type, reason,
+				ops | 1 << OP_ESCALATE, regs, test);
+
+		if (ret == 0) {
+			pr_emerg(NMIMGR_NAME": Captured all CPUs on "
+				"Event:0x%02x(%d), same event within %ums "
+				"will panic\n", reason, reason, escalate_window);
+			this_cpu_inc(nmimgr_stats->ops[OP_ESCALATE]);
+		}
+		__nmimgr_record(type, reason, ops | 1 << OP_ESCALATE, regs);
+		return NMI_HANDLED;
+	}
+
+	/* Panic NMI */
+	if (__nmimgr_has(act, OP_PANIC))
+		return __nmimgr_panic(type, reason, ops, regs, test);
+
+	/* Still there: unmanaged NMI Code. Send to other handlers */
+	pr_notice(NMIMGR_NAME": Unmanaged NMI event:0x%02x (%d), let it pass\n",
+		reason, reason);
+	if (!ops)
+		this_cpu_inc(nmimgr_stats->unmanaged);
+	__nmimgr_record(type, reason, ops, regs);
+
+	return NMI_DONE;
+}
+
+
+
+
+static inline int __nmimgr_hist_idx(u64 ns)
+{
+	int i = fls64(ns);
+
+	return i < NMIMGR_HIST_BUCKETS ? i : NMIMGR_HIST_BUCKETS - 1;
+}
+
+/**
+ * Storm test running: account and claim the NMIs sent to this CPU, so the
+ * kernel does not complain about them. Others go to the handler as usual
+ */
+static int __nmimgr_storm_handle(unsigned int type, unsigned char reason,
+			struct pt_regs *regs)
+{
+	struct nmimgr_storm_cpu *sc = this_cpu_ptr(&nmimgr_storm_cpu);
+	u64 now = local_clock();
+
+	if (sc->recv >= READ_ONCE(sc->sent))
+		return __nmimgr_handle(type, reason, regs, READ_ONCE(test_mode));
+
+	sc->recv++;
+	/* local_clock of 2 CPUs: only accurate with a stable TSC */
+	sc->lat[__nmimgr_hist_idx(now - READ_ONCE(sc->send_ts))]++;
+
+	/* Ours: the storm was started in test_mode */
+	__nmimgr_handle(type, reason, regs, true);
+	sc->dur[__nmimgr_hist_idx(local_clock() - now)]++;
+
+	return NMI_HANDLED;
+}
+
+static inline int nmimgr_dispatch(unsigned int type, unsigned char reason,
+			struct pt_regs *regs)
+{
+	u64 start;
+	int ret;
+
+	if (unlikely(READ_ONCE(nmimgr_storm.active)))
+		return __nmimgr_storm_handle(type, reason, regs);
+
+	start = local_clock();
+	ret = __nmimgr_handle(type, reason, regs, READ_ONCE(test_mode));
+	this_cpu_add(nmimgr_stats->handler_ns, local_clock() - start);
+
+	return ret;
+}
+
+
+/***** Kernel < 3.2 **********************************************************/
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 2, 0)
+
+static int nmimgr_handle(struct notifier_block *nb, unsigned long val,
+			void *data)
+{
+	struct die_args *args = (struct die_args *)data;
+
+	/*
+	 * DIE_NMI_IPI is raised for every NMI, including the watchdog and perf
+	 * ones on each CPU: filter them before anything else. External NMIs
+	 * come back as DIE_NMI (SERR/IOCHK) or DIE_NMIUNKNOWN if unclaimed.
+	 */
+	switch (val) {
+	case DIE_NMI:
+		return nmimgr_dispatch(
+			args->err & NMI_REASON_SERR ? NMI_SERR : NMI_IO_CHECK,
+			args->err, args->regs);
+
+	case DIE_NMIUNKNOWN:
+		return nmimgr_dispatch(NMI_UNKNOWN, args->err, args->regs);
+
+	case DIE_NMI_IPI:
+		/*
+		 * Our own capture request. External NMIs come here first too,
+		 * so the others are not counted as local
+		 */
+		if (__nmimgr_bt_handle(args->regs) == NMI_HANDLED)
+			return NOTIFY_STOP;
+		return NOTIFY_DONE;
+
+	case DIE_NMIWATCHDOG:
+		this_cpu_inc(nmimgr_stats->local_skipped);
+		return NOTIFY_DONE;
+
+	default:
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+
+static struct notifier_block nmimgr_notifier = {
+	.notifier_call = nmimgr_handle,
+	.priority = 0x7FFFFFFF
+};
+
+
+/**
+ * Handler registration
+ */
+static int nmimgr_register(void)
+{
+	int ret = register_die_notifier(&nmimgr_notifier);
+
+	if (ret) {
+		pr_warn(NMIMGR_NAME": Unable to register NMI handler\n");
+		return ret;
+	}
+
+	pr_notice(NMIMGR_NAME": Registered handler\n");
+
+	return 0;
+}
+
+/**
+ * Handler unregistration
+ */
+static void nmimgr_unregister(void)
+{
+	unregister_die_notifier(&nmimgr_notifier);
+}
+
+/***** Kernel 3.2+ ***********************************************************/
+#else
+
+static int nmimgr_handle(unsigned int type, struct pt_regs *regs)
+{
+	struct nmimgr_pending *p = this_cpu_ptr(&nmimgr_pending);
+	unsigned char reason = x86_platform.get_nmi_reason();
+	int ret;
+
+	/* Set by __nmimgr_record_ev() */
+	p->seq = ~0ULL;
+	ret = nmimgr_dispatch(type, reason, regs);
+
+	/* Let the terminal handler know what we passed */
+	if (READ_ONCE(nmimgr_catch) && ret == NMI_DONE) {
+		p->claims = 0;
+		p->type   = type;
+		p->reason = reason;
+		p->armed  = true;
+	}
+
+	return ret;
+}
+
+static int nmimgr_bt_handle(unsigned int type, struct pt_regs *regs)
+{
+	return __nmimgr_bt_handle(regs);
+}
+
+
+
+/**
+ * handler registration
+ */
+static int nmimgr_register(void)
+{
+	int ret = 0;
+	int i;
+
+	/* A loop wont work because of Macro rewriting of
+	 * register_nmi_handler (https://lkml.org/lkml/2012/3/8/386)
+	 */
+
+	/* We register our handler first, as we only manage a specific list */
+	ret = register_nmi_handler(
+	    NMI_UNKNOWN, nmimgr_handle, NMI_FLAG_FIRST, NMIMGR_NAME);
+	if (ret) {
+		pr_warn(NMIMGR_NAME ": Unable to register NMI_UNKNOWN\n");
+		i = NMI_UNKNOWN-1;
+		goto err;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	ret = register_nmi_handler(
+		NMI_SERR, nmimgr_handle, NMI_FLAG_FIRST, NMIMGR_NAME);
+	if (ret) {
+		pr_warn(NMIMGR_NAME ": Unable to register NMI_SERR\n");
+		i = NMI_SERR-1;
+		goto err;
+	}
+	ret = register_nmi_handler(
+		NMI_IO_CHECK, nmimgr_handle, NMI_FLAG_FIRST, NMIMGR_NAME);
+	if (ret) {
+		pr_warn(NMIMGR_NAME ": Unable to register NMI_IO_CHECK\n");
+		i = NMI_IO_CHECK-1;
+		goto err;
+	}
+#endif
+
+	/* Without it, escalations only capture the CPU receiving the NMI */
+	if (register_nmi_handler(
+	    NMI_LOCAL, nmimgr_bt_handle, NMI_FLAG_FIRST, NMIMGR_NAME"_bt"))
+		pr_warn(NMIMGR_NAME ": Unable to register NMI_LOCAL\n");
+
+	return 0;
+
+err:
+	for (; i > 0; i--)
+		unregister_nmi_handler(i, NMIMGR_NAME);
+
+	return ret;
+}
+
+/**
+ * Handler unregistration
+ */
+static void nmimgr_unregister(void)
+{
+	int i;
+
+	for (i = NMI_MAX-1; i > NMI_LOCAL; i--)
+		unregister_nmi_handler(i, NMIMGR_NAME);
+
+	unregister_nmi_handler(NMI_LOCAL, NMIMGR_NAME"_bt");
+
+}
+
+#endif
+
+/*****************************************************************************/
+
+static int __init __nmimgr_setup(struct nmimgr_policy *pol, int op,
+			char *str)
+{
+	const char *ret = NULL;
+
+	if (!str)
+		return 1;
+
+	/* Expand the rules into the per-event table */
+	if (nmimgr_policy_parse(pol, op, str, &ret)) {
+		pr_err(NMIMGR_NAME": Invalid input '%s', ret:%s\n", str, ret);
+		return 0;
+	}
+	return 1;
+}
+
+
+#ifndef NMIMGR_BAKED
+/**
+ * Parse the input string
+ */
+static int __init nmimgr_setup_panic(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": events_panic: %s\n", str);
+	return __nmimgr_setup(&nmimgr_policy.live, OP_PANIC, str);
+}
+__setup("nmimgr.events_panic=", nmimgr_setup_panic);
+
+
+/**
+ *
+ */
+static int __init nmimgr_setup_debug(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": events_debug: %s\n", str);
+	return __nmimgr_setup(&nmimgr_policy.live, OP_DEBUG, str);
+}
+__setup("nmimgr.events_debug=", nmimgr_setup_debug);
+
+
+/**
+ *
+ */
+static int __init nmimgr_setup_ignore(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": events_ignore: %s\n", str);
+	return __nmimgr_setup(&nmimgr_policy.live, OP_IGNORE, str);
+}
+__setup("nmimgr.events_ignore=", nmimgr_setup_ignore);
+
+/**
+ *
+ */
+static int __init nmimgr_setup_drop(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": events_drop: %s\n", str);
+	return __nmimgr_setup(&nmimgr_policy.live, OP_DROP, str);
+}
+__setup("nmimgr.events_drop=", nmimgr_setup_drop);
+
+/**
+ *
+ */
+static int __init nmimgr_setup_escalate(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": events_escalate: %s\n", str);
+	return __nmimgr_setup(&nmimgr_policy.live, OP_ESCALATE, str);
+}
+__setup("nmimgr.events_escalate=", nmimgr_setup_escalate);
+#endif
+
+/**
+ *
+ */
+static int __init nmimgr_setup_unclaimed_drop(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": unclaimed_drop: %s\n", str);
+	catch_unclaimed = true;
+	return __nmimgr_setup(&nmimgr_unclaimed, OP_DROP, str);
+}
+__setup("nmimgr.unclaimed_drop=", nmimgr_setup_unclaimed_drop);
+
+/**
+ *
+ */
+static int __init nmimgr_setup_unclaimed_debug(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": unclaimed_debug: %s\n", str);
+	catch_unclaimed = true;
+	return __nmimgr_setup(&nmimgr_unclaimed, OP_DEBUG, str);
+}
+__setup("nmimgr.unclaimed_debug=", nmimgr_setup_unclaimed_debug);
+
+/**
+ *
+ */
+static int __init nmimgr_setup_unclaimed_panic(char *str)
+{
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": unclaimed_panic: %s\n", str);
+	catch_unclaimed = true;
+	return __nmimgr_setup(&nmimgr_unclaimed, OP_PANIC, str);
+}
+__setup("nmimgr.unclaimed_panic=", nmimgr_setup_unclaimed_panic);
+
+/**
+ * RATE@LIST groups, separated by ';'
+ */
+static int __init nmimgr_setup_sample(char *str)
+{
+	const char *ret = NULL;
+
+	if (!str)
+		return 1;
+
+	pr_info(NMIMGR_NAME ": events_sample: %s\n", str);
+	if (nmimgr_sample_parse(nmimgr_sample, str, &ret)) {
+		pr_err(NMIMGR_NAME": Invalid input '%s', ret:%s\n", str, ret);
+		return 0;
+	}
+	return 1;
+}
+__setup("nmimgr.events_sample=", nmimgr_setup_sample);
+
+static int nmimgr_check_window(unsigned int window)
+{
+	if (window > NMIMGR_ESCALATE_HOLDOFF_MS)
+		return 0;
+	pr_err(NMIMGR_NAME": escalate_window %u must be over %ums\n", window,
+		NMIMGR_ESCALATE_HOLDOFF_MS);
+	return -EINVAL;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+static int nmimgr_set_window(const char *val, const struct kernel_param *kp)
+{
+	unsigned int window;
+
+	if (kstrtouint(val, 0, &window) || nmimgr_check_window(window))
+		return -EINVAL;
+	WRITE_ONCE(escalate_window, window);
+	return 0;
+}
+
+static const struct kernel_param_ops nmimgr_window_ops = {
+	.set = nmimgr_set_window,
+	.get = param_get_uint,
+};
+#endif
+
+
+
+/***** Self-test *************************************************************/
+
+/* Average cycles expected to look up and decide the actions of one event */
+#define NMIMGR_SELFTEST_CYCLES  100
+#define NMIMGR_SELFTEST_LOOPS   64
+/* Runs of the timing loop, the best one is kept against the noise */
+#define NMIMGR_SELFTEST_RUNS    16
+
+/* Lists, with the codes they must match as up to 4 ranges */
+static const struct {
+	const char *list;
+	unsigned int nr;
+	struct {
+		unsigned char lo, hi;
+	} range[4];
+} nmimgr_selftest_lists[] __initconst = {
+	{ "",             0 },
+	{ "0",            1, { { 0, 0 } } },
+	{ "255",          1, { { 255, 255 } } },
+	{ "0,13,16",      3, { { 0, 0 }, { 13, 13 }, { 16, 16 } } },
+	{ "1,",           1, { { 1, 1 } } },
+	{ "10-100",       1, { { 10, 100 } } },
+	{ "0-255",        1, { { 0, 255 } } },
+	{ "0x3c,060,1-2", 3, { { 1, 2 }, { 48, 48 }, { 60, 60 } } },
+	{ "0x20:0x20",    4, { { 32, 63 }, { 96, 127 }, { 160, 191 },
+	                       { 224, 255 } } },
+	{ "0xe0:0x20",    1, { { 32, 63 } } },
+	{ "0xc0:0",       1, { { 0, 63 } } },
+	{ "0xff:0",       1, { { 0, 0 } } },
+};
+
+static const char * const nmimgr_selftest_invalid[] __initconst = {
+	"256", "5-3", "1-", "-1", "1,,2", "abc", "3x", "0x", "09",
+	"0x20:0x21", ":1", "0x100:0",
+};
+
+static struct nmimgr_policy nmimgr_selftest_pol __initdata;
+static unsigned char nmimgr_selftest_sink;
+
+static bool __init nmimgr_selftest_in(unsigned int i, unsigned int r)
+{
+	unsigned int n;
+
+	for (n = 0; n < nmimgr_selftest_lists[i].nr; n++) {
+		if (r >= nmimgr_selftest_lists[i].range[n].lo &&
+		    r <= nmimgr_selftest_lists[i].range[n].hi)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Each list sets its op on exactly its codes, for all types, and the
+ * invalid ones are refused
+ */
+static int __init nmimgr_selftest_parse(void)
+{
+	struct nmimgr_policy *pol = &nmimgr_selftest_pol;
+	const char *err;
+	unsigned int i, t, r, want;
+	int fails = 0;
+
+	for (i = 0; i < ARRAY_SIZE(nmimgr_selftest_lists); i++) {
+		nmimgr_policy_init(pol);
+		if (nmimgr_policy_parse(pol, OP_DEBUG,
+				nmimgr_selftest_lists[i].list, &err)) {
+			pr_err(NMIMGR_NAME": selftest: '%s' refused at '%s'\n",
+				nmimgr_selftest_lists[i].list, err);
+			fails++;
+			continue;
+		}
+
+		for (t = 0; t < NMIMGR_NTYPES; t++) {
+			for (r = 0; r < NMIMGR_NBMAX; r++) {
+				want = nmimgr_selftest_in(i, r) ? 1 << OP_DEBUG : 0;
+				if (pol->act[t][r] == want)
+					continue;
+				pr_err(NMIMGR_NAME": selftest: '%s' type:%u "
+					"event:0x%02x is 0x%02x, not 0x%02x\n",
+					nmimgr_selftest_lists[i].list, t, r,
+					pol->act[t][r], want);
+				fails++;
+			}
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(nmimgr_selftest_invalid); i++) {
+		nmimgr_policy_init(pol);
+		if (nmimgr_policy_parse(pol, OP_DEBUG,
+				nmimgr_selftest_invalid[i], &err))
+			continue;
+		pr_err(NMIMGR_NAME": selftest: invalid '%s' accepted\n",
+			nmimgr_selftest_invalid[i]);
+		fails++;
+	}
+
+	return fails;
+}
+
+/**
+ * Decisions of a reference policy with overlapping lists, per type, against
+ * the precedence ignore > debug (kept) > drop > escalate > panic
+ */
+static int __init nmimgr_selftest_decide(void)
+{
+	struct nmimgr_policy *pol = &nmimgr_selftest_pol;
+	const char *err = NULL;
+	unsigned int t, r, act;
+	unsigned char got, want;
+	int fails = 0;
+
+	nmimgr_policy_init(pol);
+	if (nmimgr_policy_parse(pol, OP_PANIC, "0-255", &err) ||
+	    nmimgr_policy_parse_types(pol, 1 << NMI_UNKNOWN, OP_ESCALATE,
+			"0x80:0x80", &err) ||
+	    nmimgr_policy_parse_types(pol, 1 << NMI_SERR | 1 << NMI_IO_CHECK,
+			OP_DROP, "0x40:0x40", &err) ||
+	    nmimgr_policy_parse(pol, OP_DEBUG, "0x0f:0x01", &err) ||
+	    nmimgr_policy_parse(pol, OP_IGNORE, "0xf0-0xff", &err)) {
+		pr_err(NMIMGR_NAME": selftest: reference refused at '%s'\n", err);
+		return 1;
+	}
+
+	for (t = 0; t < NMIMGR_NTYPES; t++) {
+		for (r = 0; r < NMIMGR_NBMAX; r++) {
+			if (r >= 0xf0)
+				want = 1 << OP_IGNORE;
+			else if ((t == NMI_SERR || t == NMI_IO_CHECK) && (r & 0x40))
+				want = 1 << OP_DROP;
+			else if (t == NMI_UNKNOWN && (r & 0x80))
+				want = 1 << OP_ESCALATE;
+			else
+				want = 1 << OP_PANIC;
+			if (want != 1 << OP_IGNORE && (r & 0x0f) == 0x01)
+				want |= 1 << OP_DEBUG;
+
+			got = nmimgr_policy_decide(pol->act[t][r]);
+			if (got == want)
+				continue;
+			pr_err(NMIMGR_NAME": selftest: type:%u event:0x%02x "
+				"does 0x%02x, not 0x%02x\n", t, r, got, want);
+			fails++;
+		}
+	}
+
+	/* Whatever the act: a subset of it, with one final action at most */
+	for (act = 0; act < 1 << OP_MAX; act++) {
+		got = nmimgr_policy_decide(act);
+		want = got & ~(1 << OP_DEBUG);
+		if ((got & ~act) || (want & (want - 1)) ||
+		    ((got & (1 << OP_IGNORE)) && got != 1 << OP_IGNORE) ||
+		    (!(act & (1 << OP_IGNORE)) &&
+		     ((got ^ act) & (1 << OP_DEBUG)))) {
+			pr_err(NMIMGR_NAME": selftest: act 0x%02x does 0x%02x\n",
+				act, got);
+			fails++;
+		}
+	}
+
+	return fails;
+}
+
+/**
+ * Cost of the handler lookup and decision, with the policy being loaded.
+ * The best of several runs is kept, so a VM exit, an SMI or a frequency
+ * change in one of them does not fail the check
+ */
+static int __init nmimgr_selftest_timing(void)
+{
+	unsigned int i, t, r, run, n;
+	unsigned char sink = 0;
+	unsigned long flags;
+	cycles_t start, cycles, best = 0;
+
+	for (run = 0; run < NMIMGR_SELFTEST_RUNS; run++) {
+		local_irq_save(flags);
+		start = get_cycles();
+		for (i = 0; i < NMIMGR_SELFTEST_LOOPS; i++)
+			for (t = 0; t < NMIMGR_NTYPES; t++)
+				for (r = 0; r < NMIMGR_NBMAX; r++)
+					sink ^= nmimgr_policy_decide(
+						__nmimgr_act(t, r));
+		cycles = get_cycles() - start;
+		local_irq_restore(flags);
+
+		/* No cycle counter */
+		if (!start)
+			return 0;
+		if (!run || cycles < best)
+			best = cycles;
+		cond_resched();
+	}
+	WRITE_ONCE(nmimgr_selftest_sink, sink);
+
+	n = div_u64(best, NMIMGR_SELFTEST_LOOPS * NMIMGR_NTYPES * NMIMGR_NBMAX);
+	pr_info(NMIMGR_NAME": selftest: %u cycles per event decision\n", n);
+	if (n <= NMIMGR_SELFTEST_CYCLES)
+		return 0;
+
+	pr_err(NMIMGR_NAME": selftest: decision over %u cycles in %u runs\n",
+		NMIMGR_SELFTEST_CYCLES, NMIMGR_SELFTEST_RUNS);
+	return 1;
+}
+
+/**
+ * Check the policy compiler and the handler decisions before loading.
+ * Returns the number of failures
+ */
+static int __init nmimgr_selftest(void)
+{
+	int fails;
+
+	fails  = nmimgr_selftest_parse();
+	fails += nmimgr_selftest_decide();
+	fails += nmimgr_selftest_timing();
+
+	if (!fails)
+		pr_info(NMIMGR_NAME": selftest: passed\n");
+	return fails;
+}
+
+
+/***** NMI handlers profiling ************************************************/
+
+/* Distinct handlers tracked, there are only a few of them on a host */
+#define NMIMGR_PROF_MAX 16
+
+struct nmimgr_prof_cpu {
+	u64 calls[NMIMGR_PROF_MAX];
+	u64 claims[NMIMGR_PROF_MAX];
+	u64 ns[NMIMGR_PROF_MAX];
+	u32 hist[NMIMGR_PROF_MAX][NMIMGR_HIST_BUCKETS];
+};
+
+static void *nmimgr_prof_fn[NMIMGR_PROF_MAX];
+/* Only allocated with profile_handlers */
+static struct nmimgr_prof_cpu __percpu *nmimgr_prof_cpu;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+static struct tracepoint *nmimgr_prof_tp;
+
+/**
+ * Slot of a handler, allocated on first sight. Lock-free as we are in NMI
+ */
+static int __nmimgr_prof_slot(void *handler)
+{
+	void *cur;
+	int i;
+
+	for (i = 0; i < NMIMGR_PROF_MAX; i++) {
+		cur = READ_ONCE(nmimgr_prof_fn[i]);
+		if (cur == handler)
+			return i;
+		if (!cur && cmpxchg(&nmimgr_prof_fn[i], NULL, handler) == NULL)
+			return i;
+		/* Lost the race: check whom it was given to */
+		if (READ_ONCE(nmimgr_prof_fn[i]) == handler)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Probe of trace_nmi_handler(), called after each handler of the NMI chains
+ */
+static void nmimgr_prof_probe(void *data, void *handler, s64 delta_ns,
+			int handled)
+{
+	struct nmimgr_pending *p = this_cpu_ptr(&nmimgr_pending);
+	struct nmimgr_prof_cpu *pc;
+	int i;
+
+	/* For the terminal handler */
+	if (p->armed)
+		p->claims += handled;
+
+	if (!profile_handlers)
+		return;
+
+	i = __nmimgr_prof_slot(handler);
+	if (i < 0)
+		return;
+
+	pc = this_cpu_ptr(nmimgr_prof_cpu);
+	pc->calls[i]++;
+	pc->ns[i] += delta_ns;
+	if (handled)
+		pc->claims[i]++;
+	pc->hist[i][__nmimgr_hist_idx(delta_ns)]++;
+}
+
+static void nmimgr_prof_lookup(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "nmi_handler"))
+		nmimgr_prof_tp = tp;
+}
+
+/**
+ * Last handler of the chain: if the NMI we passed was not claimed by the
+ * handlers between us, it is going to "Dazed and confused". Only handlers
+ * registered after nmimgr are not seen.
+ */
+static int nmimgr_last_handle(unsigned int type, struct pt_regs *regs)
+{
+	struct nmimgr_pending *p = this_cpu_ptr(&nmimgr_pending);
+	unsigned char reason = p->reason;
+	unsigned char act;
+
+	if (!p->armed || p->type != type)
+		return NMI_DONE;
+	p->armed = false;
+
+	if (p->claims) {
+		this_cpu_inc(nmimgr_stats->claimed_later);
+		return NMI_DONE;
+	}
+
+	this_cpu_inc(nmimgr_stats->unclaimed);
+	this_cpu_inc(nmimgr_stats->unclaimed_reason[reason]);
+
+	act = nmimgr_unclaimed.act[type][reason];
+	if (act & (1 << OP_DEBUG))
+		__nmimgr_debug(reason, regs);
+
+	__nmimgr_record_ev(type, reason, act, NMIMGR_EV_UNCLAIMED, (u32)p->seq,
+		regs);
+
+	if (act & (1 << OP_PANIC)) {
+		pr_emerg(NMIMGR_NAME": Panic on unclaimed Event:0x%02x(%d)\n",
+			reason, reason);
+		this_cpu_inc(nmimgr_stats->ops[OP_PANIC]);
+		return __nmimgr_do_panic(regs, READ_ONCE(test_mode));
+	}
+
+	return act & (1 << OP_DROP) ? NMI_HANDLED : NMI_DONE;
+}
+
+static void __init nmimgr_prof_init(void)
+{
+	if (!profile_handlers && !catch_unclaimed)
+		return;
+
+	/* Before the probe can use it */
+	if (profile_handlers) {
+		nmimgr_prof_cpu = alloc_percpu(struct nmimgr_prof_cpu);
+		if (!nmimgr_prof_cpu) {
+			pr_warn(NMIMGR_NAME": No memory to profile handlers\n");
+			profile_handlers = false;
+		}
+	}
+
+	for_each_kernel_tracepoint(nmimgr_prof_lookup, NULL);
+	if (!nmimgr_prof_tp ||
+	    tracepoint_probe_register(nmimgr_prof_tp, nmimgr_prof_probe, NULL)) {
+		pr_warn(NMIMGR_NAME": Unable to attach to nmi_handler "
+			"tracepoint, no profiling nor unclaimed NMIs\n");
+		nmimgr_prof_tp = NULL;
+		profile_handlers = false;
+		free_percpu(nmimgr_prof_cpu);
+		nmimgr_prof_cpu = NULL;
+		return;
+	}
+
+	if (profile_handlers)
+		pr_info(NMIMGR_NAME": Profiling all NMI handlers\n");
+}
+
+static void nmimgr_prof_exit(void)
+{
+	if (!nmimgr_prof_tp)
+		return;
+
+	tracepoint_probe_unregister(nmimgr_prof_tp, nmimgr_prof_probe, NULL);
+	tracepoint_synchronize_unregister();
+	free_percpu(nmimgr_prof_cpu);
+}
+
+static void nmimgr_last_unregister(void)
+{
+	WRITE_ONCE(nmimgr_catch, false);
+
+	unregister_nmi_handler(NMI_UNKNOWN, NMIMGR_NAME"_last");
+	unregister_nmi_handler(NMI_SERR, NMIMGR_NAME"_last");
+	unregister_nmi_handler(NMI_IO_CHECK, NMIMGR_NAME"_last");
+}
+
+/**
+ * Registered without NMI_FLAG_FIRST: after all the handlers already there
+ */
+static void __init nmimgr_last_register(void)
+{
+	if (!catch_unclaimed || !nmimgr_prof_tp)
+		return;
+
+	if (register_nmi_handler(NMI_UNKNOWN, nmimgr_last_handle, 0,
+	    NMIMGR_NAME"_last") ||
+	    register_nmi_handler(NMI_SERR, nmimgr_last_handle, 0,
+	    NMIMGR_NAME"_last") ||
+	    register_nmi_handler(NMI_IO_CHECK, nmimgr_last_handle, 0,
+	    NMIMGR_NAME"_last")) {
+		pr_warn(NMIMGR_NAME": Unable to register terminal handler\n");
+		nmimgr_last_unregister();
+		return;
+	}
+
+	WRITE_ONCE(nmimgr_catch, true);
+}
+
+#else
+static void __init nmimgr_prof_init(void)
+{
+	if (profile_handlers || catch_unclaimed)
+		pr_warn(NMIMGR_NAME": Handlers profiling and unclaimed NMIs "
+			"need kernel 3.15+\n");
+}
+
+static void nmimgr_prof_exit(void)
+{
+}
+
+static void __init nmimgr_last_register(void)
+{
+}
+
+static void nmimgr_last_unregister(void)
+{
+}
+#endif
+
+/***** perf PMU **************************************************************/
+#if defined(CONFIG_PERF_EVENTS) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+
+/*
+ * Counting only PMU over nmimgr_stats, for system-wide events:
+ *   perf stat -a -e nmimgr/nmi_seen/,nmimgr/nmi_reason,reason=0x3c/
+ * config:0-7 is the counter, config:8-15 the reason for nmi_reason
+ */
+enum {
+	NMIMGR_PMU_SEEN = 1,
+	NMIMGR_PMU_IGNORED,
+	NMIMGR_PMU_DROPPED,
+	NMIMGR_PMU_DEBUG,
+	NMIMGR_PMU_PANIC,
+	NMIMGR_PMU_PANIC_ARMED,
+	NMIMGR_PMU_UNMANAGED,
+	NMIMGR_PMU_UNCLAIMED,
+	NMIMGR_PMU_HANDLER_NS,
+	NMIMGR_PMU_REASON,
+	NMIMGR_PMU_MAX
+};
+
+static bool nmimgr_pmu_registered;
+
+static u64 nmimgr_pmu_value(u64 config, int cpu)
+{
+	struct nmimgr_stats *st = per_cpu_ptr(nmimgr_stats, cpu);
+
+	switch (config & 0xff) {
+	case NMIMGR_PMU_SEEN:        return READ_ONCE(st->seen);
+	case NMIMGR_PMU_IGNORED:     return READ_ONCE(st->ops[OP_IGNORE]);
+	case NMIMGR_PMU_DROPPED:     return READ_ONCE(st->ops[OP_DROP]);
+	case NMIMGR_PMU_DEBUG:       return READ_ONCE(st->ops[OP_DEBUG]);
+	case NMIMGR_PMU_PANIC:       return READ_ONCE(st->ops[OP_PANIC]);
+	case NMIMGR_PMU_PANIC_ARMED: return READ_ONCE(st->ops[OP_ESCALATE]);
+	case NMIMGR_PMU_UNMANAGED:   return READ_ONCE(st->unmanaged);
+	case NMIMGR_PMU_UNCLAIMED:   return READ_ONCE(st->unclaimed);
+	case NMIMGR_PMU_HANDLER_NS:  return READ_ONCE(st->handler_ns);
+	case NMIMGR_PMU_REASON:
+		return READ_ONCE(st->reason[(config >> 8) & 0xff]);
+	}
+	return 0;
+}
+
+static void nmimgr_pmu_update(struct perf_event *event)
+{
+	u64 prev, now;
+
+	do {
+		prev = local64_read(&event->hw.prev_count);
+		now = nmimgr_pmu_value(event->attr.config, event->cpu);
+	} while (local64_cmpxchg(&event->hw.prev_count, prev, now) != prev);
+
+	local64_add(now - prev, &event->count);
+}
+
+static int nmimgr_pmu_event_init(struct perf_event *event)
+{
+	u64 id = event->attr.config & 0xff;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+
+	/* Per-cpu counters, no task nor sampling */
+	if (event->cpu < 0 || is_sampling_event(event))
+		return -EINVAL;
+
+	if (!id || id >= NMIMGR_PMU_MAX || event->attr.config >> 16)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void nmimgr_pmu_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count,
+		nmimgr_pmu_value(event->attr.config, event->cpu));
+}
+
+static void nmimgr_pmu_stop(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_UPDATE)
+		nmimgr_pmu_update(event);
+}
+
+static int nmimgr_pmu_add(struct perf_event *event, int flags)
+{
+	if (flags & PERF_EF_START)
+		nmimgr_pmu_start(event, flags);
+	return 0;
+}
+
+static void nmimgr_pmu_del(struct perf_event *event, int flags)
+{
+	nmimgr_pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static void nmimgr_pmu_read(struct perf_event *event)
+{
+	nmimgr_pmu_update(event);
+}
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+PMU_FORMAT_ATTR(reason, "config:8-15");
+
+static struct attribute *nmimgr_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	&format_attr_reason.attr,
+	NULL,
+};
+
+static struct attribute_group nmimgr_pmu_format_group = {
+	.name  = "format",
+	.attrs = nmimgr_pmu_format_attrs,
+};
+
+PMU_EVENT_ATTR_STRING(nmi_seen, nmimgr_pmu_seen, "event=0x01");
+PMU_EVENT_ATTR_STRING(nmi_ignored, nmimgr_pmu_ignored, "event=0x02");
+PMU_EVENT_ATTR_STRING(nmi_dropped, nmimgr_pmu_dropped, "event=0x03");
+PMU_EVENT_ATTR_STRING(nmi_debug, nmimgr_pmu_debug, "event=0x04");
+PMU_EVENT_ATTR_STRING(nmi_panic, nmimgr_pmu_panic, "event=0x05");
+PMU_EVENT_ATTR_STRING(nmi_panic_armed, nmimgr_pmu_panic_armed, "event=0x06");
+PMU_EVENT_ATTR_STRING(nmi_unmanaged, nmimgr_pmu_unmanaged, "event=0x07");
+PMU_EVENT_ATTR_STRING(nmi_unclaimed, nmimgr_pmu_unclaimed, "event=0x08");
+PMU_EVENT_ATTR_STRING(handler_ns, nmimgr_pmu_handler_ns, "event=0x09");
+PMU_EVENT_ATTR_STRING(handler_ns.unit, nmimgr_pmu_handler_ns_unit, "ns");
+PMU_EVENT_ATTR_STRING(nmi_reason, nmimgr_pmu_reason, "event=0x0a,reason=?");
+
+static struct attribute *nmimgr_pmu_event_attrs[] = {
+	&nmimgr_pmu_seen.attr.attr,
+	&nmimgr_pmu_ignored.attr.attr,
+	&nmimgr_pmu_dropped.attr.attr,
+	&nmimgr_pmu_debug.attr.attr,
+	&nmimgr_pmu_panic.attr.attr,
+	&nmimgr_pmu_panic_armed.attr.attr,
+	&nmimgr_pmu_unmanaged.attr.attr,
+	&nmimgr_pmu_unclaimed.attr.attr,
+	&nmimgr_pmu_handler_ns.attr.attr,
+	&nmimgr_pmu_handler_ns_unit.attr.attr,
+	&nmimgr_pmu_reason.attr.attr,
+	NULL,
+};
+
+static struct attribute_group nmimgr_pmu_events_group = {
+	.name  = "events",
+	.attrs = nmimgr_pmu_event_attrs,
+};
+
+static const struct attribute_group *nmimgr_pmu_attr_groups[] = {
+	&nmimgr_pmu_format_group,
+	&nmimgr_pmu_events_group,
+	NULL,
+};
+
+static struct pmu nmimgr_pmu = {
+	.module       = THIS_MODULE,
+	.task_ctx_nr  = perf_invalid_context,
+	.attr_groups  = nmimgr_pmu_attr_groups,
+	.capabilities = PERF_PMU_CAP_NO_INTERRUPT,
+	.event_init   = nmimgr_pmu_event_init,
+	.add          = nmimgr_pmu_add,
+	.del          = nmimgr_pmu_del,
+	.start        = nmimgr_pmu_start,
+	.stop         = nmimgr_pmu_stop,
+	.read         = nmimgr_pmu_read,
+};
+
+static void __init nmimgr_pmu_init(void)
+{
+	if (perf_pmu_register(&nmimgr_pmu, NMIMGR_NAME, -1)) {
+		pr_warn(NMIMGR_NAME": Unable to register the perf PMU\n");
+		return;
+	}
+	nmimgr_pmu_registered = true;
+}
+
+static void nmimgr_pmu_exit(void)
+{
+	if (nmimgr_pmu_registered)
+		perf_pmu_unregister(&nmimgr_pmu);
+}
+
+#else
+static void __init nmimgr_pmu_init(void)
+{
+}
+
+static void nmimgr_pmu_exit(void)
+{
+}
+#endif
+
+/*****************************************************************************/
+
+/**
+ * Sum the per-cpu counters. nmimgr_stats only holds u64 so walk it as such
+ */
+static void nmimgr_stats_sum(struct nmimgr_stats *sum)
+{
+	u64 *dst = (u64 *)sum;
+	u64 *src;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		src = (u64 *)per_cpu_ptr(nmimgr_stats, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+			dst[i] += src[i];
+	}
+}
+
+static void nmimgr_print_ops(struct seq_file *m, unsigned char ops)
+{
+	int i;
+	const char *sep = "";
+
+	if (!ops) {
+		seq_puts(m, "pass");
+		return;
+	}
+
+	for (i = 0; i < OP_MAX; i++) {
+		if (ops & (1 << i)) {
+			seq_printf(m, "%s%s", sep, nmimgr_opnames[i]);
+			sep = "+";
+		}
+	}
+}
+
+static int nmimgr_stats_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_stats *sum;
+	int i, j, cpu;
+	u64 n;
+
+	/* Too large for the stack */
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+	nmimgr_stats_sum(sum);
+
+	seq_printf(m, "seen: %llu\n", sum->seen);
+	for (i = 0; i < OP_MAX; i++)
+		seq_printf(m, "%s: %llu\n", nmimgr_opnames[i], sum->ops[i]);
+	seq_printf(m, "unmanaged: %llu\n", sum->unmanaged);
+	seq_printf(m, "test_panic: %llu\n", sum->test_panic);
+	seq_printf(m, "local_skipped: %llu\n", sum->local_skipped);
+	seq_printf(m, "ack_serr: %llu\n", sum->ack_serr);
+	seq_printf(m, "ack_iochk: %llu\n", sum->ack_iochk);
+	seq_printf(m, "refire: %llu\n", sum->refire);
+	seq_printf(m, "overbudget: %llu\n", sum->overbudget);
+	seq_printf(m, "degraded: %llu\n", sum->degraded);
+	seq_printf(m, "claimed_later: %llu\n", sum->claimed_later);
+	seq_printf(m, "unclaimed: %llu\n", sum->unclaimed);
+	seq_printf(m, "sampled: %llu\n", sum->sampled);
+	seq_printf(m, "coalesced: %llu\n", sum->coalesced);
+	seq_printf(m, "depot_full: %llu\n", sum->depot_full);
+	seq_printf(m, "handler_ns: %llu\n", sum->handler_ns);
+	for (i = 0; i < OP_MAX; i++)
+		seq_printf(m, "shadow_%s: %llu\n", nmimgr_opnames[i],
+			sum->shadow_ops[i]);
+
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		if (sum->reason[i])
+			seq_printf(m, "reason 0x%02x: %llu\n", i, sum->reason[i]);
+	}
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		if (sum->unclaimed_reason[i])
+			seq_printf(m, "unclaimed 0x%02x: %llu\n", i,
+				sum->unclaimed_reason[i]);
+	}
+
+	/* What the shadow policy would do, per reason */
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		for (j = 0; j < OP_MAX; j++)
+			if (sum->shadow_reason[i][j])
+				break;
+		if (j == OP_MAX)
+			continue;
+
+		seq_printf(m, "shadow_reason 0x%02x:", i);
+		for (j = 0; j < OP_MAX; j++)
+			if (sum->shadow_reason[i][j])
+				seq_printf(m, " %s=%llu", nmimgr_opnames[j],
+					sum->shadow_reason[i][j]);
+		seq_putc(m, '\n');
+	}
+
+	/* Where the shadow policy would not do as the live one, and on which CPU */
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		if (!sum->shadow_diff[i])
+			continue;
+
+		seq_printf(m, "shadow 0x%02x: %llu", i, sum->shadow_diff[i]);
+		for_each_possible_cpu(cpu) {
+			n = per_cpu_ptr(nmimgr_stats, cpu)->shadow_diff[i];
+			if (n)
+				seq_printf(m, " cpu%d=%llu", cpu, n);
+		}
+		seq_putc(m, '\n');
+	}
+
+	kfree(sum);
+	return 0;
+}
+
+static int nmimgr_events_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_ring *ring;
+	struct nmimgr_event ev;
+	u64 head, i;
+	int cpu;
+
+	/* Buffers are freed by the hotplug teardown */
+	cpus_read_lock();
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu(nmimgr_ring, cpu);
+		if (!ring)
+			continue;
+
+		head = READ_ONCE(ring->head);
+		i = head > ring_size ? head - ring_size : 0;
+
+		for (; i < head; i++) {
+			ev = ring->ev[i & nmimgr_ring_mask];
+			/* Overwritten while we were reading */
+			if (ev.seq != (u32)i)
+				continue;
+
+			seq_printf(m, "ts=%llu cpu=%u seq=%u type=%u reason=0x%02x ops=",
+				ev.ts, ev.cpu, ev.seq, ev.type, ev.reason);
+			nmimgr_print_ops(m, ev.ops);
+			if (ev.count > 1)
+				seq_printf(m, " count=%u last=%llu", ev.count,
+					ev.last);
+			if (ev.flags & NMIMGR_EV_UNCLAIMED)
+				seq_printf(m, " unclaimed ref=%u", ev.ref);
+			if (ev.stack)
+				seq_printf(m, " stack=%u", ev.stack);
+			seq_printf(m, " gen=%u pid=%u preempt=0x%x ctx=%s%s "
+				"comm=%.16s ip=%pS\n", ev.gen, ev.pid, ev.preempt,
+				ev.ctx & NMIMGR_CTX_USER ? "user" : "kernel",
+				ev.ctx & NMIMGR_CTX_IRQOFF ? ",irqoff" : "",
+				ev.comm, (void *)(unsigned long)ev.ip);
+		}
+	}
+	cpus_read_unlock();
+
+	return 0;
+}
+
+static int nmimgr_backtraces_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_bt *bt;
+	unsigned int i;
+	int cpu;
+
+	cpus_read_lock();
+	for_each_possible_cpu(cpu) {
+		bt = per_cpu(nmimgr_bt, cpu);
+		if (!bt || !READ_ONCE(bt->ts))
+			continue;
+
+		seq_printf(m, "cpu=%d ts=%llu pid=%u comm=%.16s ip=%pS\n",
+			cpu, bt->ts, bt->pid, bt->comm, (void *)(unsigned long)bt->ip);
+		for (i = 0; i < bt->nr && i < NMIMGR_BT_DEPTH; i++)
+			seq_printf(m, "  %pS\n", (void *)(unsigned long)bt->entries[i]);
+	}
+	cpus_read_unlock();
+
+	return 0;
+}
+
+static int nmimgr_stacks_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_stack *st;
+	unsigned int i, j, nr;
+
+	for (i = 0; i < NMIMGR_DEPOT_SIZE; i++) {
+		st = &nmimgr_depot[i];
+		nr = READ_ONCE(st->nr);
+		if (!nr || nr == NMIMGR_STACK_BUSY)
+			continue;
+		smp_rmb();
+
+		seq_printf(m, "stack=%u hits=%llu ts=%llu\n", i + 1,
+			(u64)atomic64_read((atomic64_t *)&st->hits), st->ts);
+		for (j = 0; j < nr && j < NMIMGR_BT_DEPTH; j++)
+			seq_printf(m, "  %pS\n", (void *)(unsigned long)st->entries[j]);
+	}
+
+	return 0;
+}
+
+/**
+ * Run the real handler "count" times, as if the NMI came with this reason.
+ * IRQs are disabled like in NMI context. The run is started in test_mode:
+ * its panics are only counted, even if test_mode is cleared meanwhile
+ */
+static void nmimgr_inject(unsigned int type, unsigned int reason,
+			unsigned int count)
+{
+	struct pt_regs regs;
+	unsigned long flags;
+	unsigned int i;
+	u64 start, delta;
+
+	nmimgr_inject_res.type    = type;
+	nmimgr_inject_res.reason  = reason;
+	nmimgr_inject_res.count   = count;
+	nmimgr_inject_res.handled = 0;
+	nmimgr_inject_res.min     = ~0ULL;
+	nmimgr_inject_res.max     = 0;
+	nmimgr_inject_res.total   = 0;
+
+	for (i = 0; i < count; i++) {
+		local_irq_save(flags);
+#ifdef CONFIG_KEXEC_CORE
+		crash_setup_regs(&regs, NULL);
+#else
+		memset(&regs, 0, sizeof(regs));
+		regs.ip = _THIS_IP_;
+#endif
+		start = local_clock();
+		if (__nmimgr_handle(type, reason, &regs, true) == NMI_HANDLED)
+			nmimgr_inject_res.handled++;
+		delta = local_clock() - start;
+		local_irq_restore(flags);
+
+		nmimgr_inject_res.total += delta;
+		if (delta < nmimgr_inject_res.min)
+			nmimgr_inject_res.min = delta;
+		if (delta > nmimgr_inject_res.max)
+			nmimgr_inject_res.max = delta;
+
+		cond_resched();
+	}
+}
+
+/**
+ * Format: "type reason count"
+ */
+static ssize_t nmimgr_inject_write(struct file *file, const char __user *ubuf,
+			size_t len, loff_t *ppos)
+{
+	char buf[64];
+	unsigned int type, reason, count = 1;
+
+	/* A panic reason would take the host down */
+	if (!READ_ONCE(test_mode))
+		return -EPERM;
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = 0;
+
+	if (sscanf(buf, "%u %i %u", &type, &reason, &count) < 2)
+		return -EINVAL;
+	if (type >= NMIMGR_NTYPES || reason >= NMIMGR_NBMAX || !count)
+		return -EINVAL;
+
+	mutex_lock(&nmimgr_inject_lock);
+	nmimgr_inject(type, reason, count);
+	mutex_unlock(&nmimgr_inject_lock);
+
+	return len;
+}
+
+static int nmimgr_inject_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&nmimgr_inject_lock);
+	if (nmimgr_inject_res.count) {
+		seq_printf(m, "type=%u reason=0x%02x count=%u handled=%u "
+			"min_ns=%llu avg_ns=%llu max_ns=%llu\n",
+			nmimgr_inject_res.type, nmimgr_inject_res.reason,
+			nmimgr_inject_res.count, nmimgr_inject_res.handled,
+			nmimgr_inject_res.min,
+			div_u64(nmimgr_inject_res.total, nmimgr_inject_res.count),
+			nmimgr_inject_res.max);
+	}
+	mutex_unlock(&nmimgr_inject_lock);
+
+	return 0;
+}
+
+static int nmimgr_inject_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_inject_show, NULL);
+}
+
+/**
+ * Storm generator, sends a round of NMIs to the target CPUs on each tick
+ */
+static enum hrtimer_restart nmimgr_storm_tick(struct hrtimer *timer)
+{
+	struct nmimgr_storm_cpu *sc;
+	u64 now = local_clock();
+	int cpu;
+
+	if (nmimgr_storm.stopping) {
+		WRITE_ONCE(nmimgr_storm.active, false);
+		return HRTIMER_NORESTART;
+	}
+
+	if (now >= nmimgr_storm.end) {
+		nmimgr_storm.stopping = true;
+		hrtimer_forward_now(timer, ns_to_ktime(NMIMGR_STORM_GRACE_NS));
+		return HRTIMER_RESTART;
+	}
+
+	for_each_cpu(cpu, &nmimgr_storm.mask) {
+		sc = per_cpu_ptr(&nmimgr_storm_cpu, cpu);
+		WRITE_ONCE(sc->send_ts, now);
+		WRITE_ONCE(sc->sent, sc->sent + 1);
+	}
+	smp_wmb();
+	__nmimgr_send_nmi(&nmimgr_storm.mask);
+
+	hrtimer_forward_now(timer, ns_to_ktime(nmimgr_storm.period));
+	return HRTIMER_RESTART;
+}
+
+static void nmimgr_storm_stop(void)
+{
+	hrtimer_cancel(&nmimgr_storm.timer);
+
+	if (nmimgr_storm.active) {
+		/* Let the NMIs in flight reach the handler */
+		msleep(NMIMGR_STORM_GRACE_NS / NSEC_PER_MSEC);
+		nmimgr_storm.end = local_clock();
+		WRITE_ONCE(nmimgr_storm.active, false);
+	}
+}
+
+static int nmimgr_storm_start(unsigned int rate, unsigned int duration,
+			const char *cpulist)
+{
+	int cpu, ret;
+
+	if (cpulist) {
+		ret = cpulist_parse(cpulist, &nmimgr_storm.mask);
+		if (ret)
+			return ret;
+		cpumask_and(&nmimgr_storm.mask, &nmimgr_storm.mask,
+			cpu_online_mask);
+	} else {
+		cpumask_copy(&nmimgr_storm.mask, cpu_online_mask);
+	}
+	if (cpumask_empty(&nmimgr_storm.mask))
+		return -EINVAL;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&nmimgr_storm_cpu, cpu), 0,
+			sizeof(struct nmimgr_storm_cpu));
+
+	nmimgr_storm.rate     = rate;
+	nmimgr_storm.period   = max_t(u64, NSEC_PER_SEC / rate,
+		NMIMGR_STORM_MIN_PERIOD_NS);
+	nmimgr_storm.start    = local_clock();
+	nmimgr_storm.end      = nmimgr_storm.start +
+		(u64)duration * NSEC_PER_MSEC;
+	nmimgr_storm.stopping = false;
+	WRITE_ONCE(nmimgr_storm.active, true);
+	smp_wmb();
+
+	hrtimer_start(&nmimgr_storm.timer, ns_to_ktime(nmimgr_storm.period),
+		HRTIMER_MODE_REL);
+	return 0;
+}
+
+/**
+ * Format: "rate duration_ms [cpulist]" or "stop". Needs test_mode as it
+ * goes through the policy, panic included
+ */
+static ssize_t nmimgr_storm_write(struct file *file, const char __user *ubuf,
+			size_t len, loff_t *ppos)
+{
+	char buf[256];
+	char cpulist[200];
+	unsigned int rate, duration;
+	int n, ret = 0;
+
+	if (!READ_ONCE(test_mode))
+		return -EPERM;
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = 0;
+
+	mutex_lock(&nmimgr_storm_lock);
+	nmimgr_storm_stop();
+
+	if (strncmp(buf, "stop", 4)) {
+		n = sscanf(buf, "%u %u %199s", &rate, &duration, cpulist);
+		if (n < 2 || !rate || !duration)
+			ret = -EINVAL;
+		else
+			ret = nmimgr_storm_start(rate, duration,
+				n > 2 ? cpulist : NULL);
+	}
+	mutex_unlock(&nmimgr_storm_lock);
+
+	return ret ? ret : len;
+}
+
+static void nmimgr_print_hist(struct seq_file *m, const char *name,
+			const u64 *hist)
+{
+	int i;
+
+	for (i = 0; i < NMIMGR_HIST_BUCKETS; i++) {
+		if (hist[i])
+			seq_printf(m, "%s_ns[%llu-%llu]: %llu\n", name,
+				i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1, hist[i]);
+	}
+}
+
+static int nmimgr_storm_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_storm_cpu *sc;
+	u64 lat[NMIMGR_HIST_BUCKETS] = {0}, dur[NMIMGR_HIST_BUCKETS] = {0};
+	u64 elapsed, sent = 0, recv = 0;
+	int cpu, i;
+
+	mutex_lock(&nmimgr_storm_lock);
+	if (!nmimgr_storm.start)
+		goto out;
+
+	elapsed = (nmimgr_storm.active ? local_clock() : nmimgr_storm.end) -
+		nmimgr_storm.start;
+	elapsed = max_t(u64, elapsed, 1);
+
+	seq_printf(m, "state=%s rate=%u elapsed_ms=%llu\n",
+		nmimgr_storm.active ? "running" : "done", nmimgr_storm.rate,
+		div_u64(elapsed, NSEC_PER_MSEC));
+
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(&nmimgr_storm_cpu, cpu);
+		if (!sc->sent)
+			continue;
+
+		seq_printf(m, "cpu=%d sent=%llu recv=%llu lost=%llu rate=%llu/s\n",
+			cpu, sc->sent, sc->recv,
+			sc->sent > sc->recv ? sc->sent - sc->recv : 0,
+			div64_u64(sc->recv * NSEC_PER_SEC, elapsed));
+		sent += sc->sent;
+		recv += sc->recv;
+		for (i = 0; i < NMIMGR_HIST_BUCKETS; i++) {
+			lat[i] += sc->lat[i];
+			dur[i] += sc->dur[i];
+		}
+	}
+
+	seq_printf(m, "total sent=%llu recv=%llu lost=%llu rate=%llu/s\n",
+		sent, recv, sent > recv ? sent - recv : 0,
+		div64_u64(recv * NSEC_PER_SEC, elapsed));
+	nmimgr_print_hist(m, "latency", lat);
+	nmimgr_print_hist(m, "handler", dur);
+
+out:
+	mutex_unlock(&nmimgr_storm_lock);
+	return 0;
+}
+
+static int nmimgr_storm_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_storm_show, NULL);
+}
+
+static int nmimgr_handlers_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_prof_cpu *pc;
+	u64 hist[NMIMGR_HIST_BUCKETS];
+	u64 calls, claims, ns;
+	void *fn;
+	int cpu, i, j;
+
+	for (i = 0; i < NMIMGR_PROF_MAX; i++) {
+		fn = READ_ONCE(nmimgr_prof_fn[i]);
+		if (!fn)
+			break;
+
+		calls = claims = ns = 0;
+		memset(hist, 0, sizeof(hist));
+		for_each_possible_cpu(cpu) {
+			pc = per_cpu_ptr(nmimgr_prof_cpu, cpu);
+			calls  += pc->calls[i];
+			claims += pc->claims[i];
+			ns     += pc->ns[i];
+			for (j = 0; j < NMIMGR_HIST_BUCKETS; j++)
+				hist[j] += pc->hist[i][j];
+		}
+
+		seq_printf(m, "handler=%ps calls=%llu claims=%llu total_ns=%llu "
+			"avg_ns=%llu\n", fn, calls, claims, ns,
+			calls ? div64_u64(ns, calls) : 0);
+		nmimgr_print_hist(m, "  duration", hist);
+
+		for_each_possible_cpu(cpu) {
+			pc = per_cpu_ptr(nmimgr_prof_cpu, cpu);
+			if (!pc->calls[i])
+				continue;
+			seq_printf(m, "  cpu=%d calls=%llu claims=%llu avg_ns=%llu\n",
+				cpu, pc->calls[i], pc->claims[i],
+				div64_u64(pc->ns[i], pc->calls[i]));
+		}
+	}
+
+	return 0;
+}
+
+static int nmimgr_handlers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_handlers_show, NULL);
+}
+
+static int nmimgr_degrade_show(struct seq_file *m, void *v)
+{
+	unsigned int level;
+	int i;
+
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		level = READ_ONCE(nmimgr_degrade[i]);
+		if (level)
+			seq_printf(m, "reason 0x%02x: %s\n", i,
+				nmimgr_debugnames[level]);
+	}
+
+	return 0;
+}
+
+/**
+ * Any write restores the full debug for all events
+ */
+static ssize_t nmimgr_degrade_write(struct file *file, const char __user *ubuf,
+			size_t len, loff_t *ppos)
+{
+	int i;
+
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		WRITE_ONCE(nmimgr_degrade[i], NMIMGR_DEBUG_FULL);
+		atomic_set(&nmimgr_strikes[i], 0);
+	}
+
+	return len;
+}
+
+/**
+ * Events per second of a CPU estimator, in thousandths. A reason quiet for
+ * longer than its mean gap decays with the time since its last NMI
+ */
+static u64 nmimgr_rate_milli(const struct nmimgr_rate *rate, int reason,
+			u64 now)
+{
+	u64 avg = READ_ONCE(rate->avg[reason]);
+	u64 last = READ_ONCE(rate->last[reason]);
+
+	if (!avg)
+		return 0;
+	if (now > last && now - last > avg)
+		avg = now - last;
+	return div64_u64(NSEC_PER_SEC * 1000ULL, avg);
+}
+
+static void nmimgr_print_milli(struct seq_file *m, u64 milli)
+{
+	u32 frac;
+	u64 whole = div_u64_rem(milli, 1000, &frac);
+
+	seq_printf(m, "%llu.%03u", whole, frac);
+}
+
+static int nmimgr_rates_show(struct seq_file *m, void *v)
+{
+	struct nmimgr_rate *rate;
+	u64 gaps[NMIMGR_GAP_BUCKETS];
+	u64 now = local_clock();
+	u64 total, milli;
+	int cpu, r, i;
+	bool seen;
+
+	/* Buffers are freed by the hotplug teardown */
+	cpus_read_lock();
+	for (r = 0; r < NMIMGR_NBMAX; r++) {
+		memset(gaps, 0, sizeof(gaps));
+		total = 0;
+		seen = false;
+
+		for_each_possible_cpu(cpu) {
+			rate = per_cpu(nmimgr_rate, cpu);
+			if (!rate || !READ_ONCE(rate->last[r]))
+				continue;
+			seen = true;
+			total += nmimgr_rate_milli(rate, r, now);
+			for (i = 0; i < NMIMGR_GAP_BUCKETS; i++)
+				gaps[i] += READ_ONCE(rate->gaps[r][i]);
+		}
+		if (!seen)
+			continue;
+
+		seq_printf(m, "reason 0x%02x: ", r);
+		nmimgr_print_milli(m, total);
+		seq_puts(m, "/s");
+		for_each_possible_cpu(cpu) {
+			rate = per_cpu(nmimgr_rate, cpu);
+			if (!rate || !(milli = nmimgr_rate_milli(rate, r, now)))
+				continue;
+			seq_printf(m, " cpu%d=", cpu);
+			nmimgr_print_milli(m, milli);
+		}
+
+		/* Upper bound of each bucket, in us */
+		seq_puts(m, "\n  gaps:");
+		for (i = 0; i < NMIMGR_GAP_BUCKETS; i++) {
+			if (!gaps[i])
+				continue;
+			if (i == NMIMGR_GAP_BUCKETS - 1)
+				seq_printf(m, " more=%llu", gaps[i]);
+			else
+				seq_printf(m, " <%lluus=%llu", 1ULL << (2 * i), gaps[i]);
+		}
+		seq_putc(m, '\n');
+	}
+	cpus_read_unlock();
+
+	return 0;
+}
+
+static int nmimgr_rates_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_rates_show, NULL);
+}
+
+static int nmimgr_degrade_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_degrade_show, NULL);
+}
+
+static int nmimgr_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_stats_show, NULL);
+}
+
+static int nmimgr_events_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_events_show, NULL);
+}
+
+static int nmimgr_backtraces_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_backtraces_show, NULL);
+}
+
+static int nmimgr_stacks_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nmimgr_stacks_show, NULL);
+}
+
+static const struct file_operations nmimgr_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_events_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_events_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_backtraces_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_backtraces_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_stacks_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_stacks_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_inject_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_inject_open,
+	.read    = seq_read,
+	.write   = nmimgr_inject_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_storm_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_storm_open,
+	.read    = seq_read,
+	.write   = nmimgr_storm_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_handlers_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_handlers_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_rates_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_rates_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations nmimgr_degrade_fops = {
+	.owner   = THIS_MODULE,
+	.open    = nmimgr_degrade_open,
+	.read    = seq_read,
+	.write   = nmimgr_degrade_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * Debugfs is optional: failures are not reported to the loader
+ */
+static void __init nmimgr_debugfs_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&nmimgr_storm.timer, nmimgr_storm_tick, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&nmimgr_storm.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	nmimgr_storm.timer.function = nmimgr_storm_tick;
+#endif
+
+	nmimgr_debugfs = debugfs_create_dir(NMIMGR_NAME, NULL);
+	if (IS_ERR_OR_NULL(nmimgr_debugfs)) {
+		nmimgr_debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", 0400, nmimgr_debugfs, NULL,
+		&nmimgr_stats_fops);
+	debugfs_create_file("events", 0400, nmimgr_debugfs, NULL,
+		&nmimgr_events_fops);
+	debugfs_create_file("backtraces", 0400, nmimgr_debugfs, NULL,
+		&nmimgr_backtraces_fops);
+	debugfs_create_file("stacks", 0400, nmimgr_debugfs, NULL,
+		&nmimgr_stacks_fops);
+	debugfs_create_file("inject", 0600, nmimgr_debugfs, NULL,
+		&nmimgr_inject_fops);
+	debugfs_create_file("storm", 0600, nmimgr_debugfs, NULL,
+		&nmimgr_storm_fops);
+	debugfs_create_file("degrade", 0600, nmimgr_debugfs, NULL,
+		&nmimgr_degrade_fops);
+	debugfs_create_file("rates", 0400, nmimgr_debugfs, NULL,
+		&nmimgr_rates_fops);
+	if (profile_handlers)
+		debugfs_create_file("handlers", 0400, nmimgr_debugfs, NULL,
+			&nmimgr_handlers_fops);
+}
+
+static void nmimgr_debugfs_exit(void)
+{
+	debugfs_remove_recursive(nmimgr_debugfs);
+
+	mutex_lock(&nmimgr_storm_lock);
+	nmimgr_storm_stop();
+	mutex_unlock(&nmimgr_storm_lock);
+}
+
+
+/***** Control device ********************************************************/
+
+/**
+ * Replace the live policies by a copy changed by the ioctl cmd. The previous
+ * ones are freed unless they are the ones from the parameters
+ */
+static int nmimgr_policy_update(unsigned int cmd,
+			const struct nmimgr_policy *pol)
+{
+#ifdef NMIMGR_BAKED
+	/* The handler only reads the baked table */
+	return -EOPNOTSUPP;
+#else
+	struct nmimgr_policies *old, *new;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	mutex_lock(&nmimgr_policy_lock);
+	old = rcu_dereference_protected(nmimgr_live,
+		lockdep_is_held(&nmimgr_policy_lock));
+	*new = *old;
+
+	switch (cmd) {
+	case NMIMGR_IOC_SET_POLICY:
+		new->live = *pol;
+		new->gen++;
+		break;
+	case NMIMGR_IOC_SET_SHADOW:
+		new->shadow = *pol;
+		new->has_shadow = true;
+		break;
+	case NMIMGR_IOC_CLEAR_SHADOW:
+		new->has_shadow = false;
+		break;
+	case NMIMGR_IOC_PROMOTE_SHADOW:
+		if (!old->has_shadow) {
+			mutex_unlock(&nmimgr_policy_lock);
+			kfree(new);
+			return -ENOENT;
+		}
+		new->live = old->shadow;
+		new->has_shadow = false;
+		new->gen++;
+		break;
+	}
+
+	rcu_assign_pointer(nmimgr_live, new);
+	WRITE_ONCE(nmimgr_crashinfo.policy, (unsigned long)&new->live);
+	mutex_unlock(&nmimgr_policy_lock);
+
+	synchronize_rcu();
+	if (old != &nmimgr_policy)
+		kfree(old);
+	return 0;
+#endif
+}
+
+static const char *nmimgr_ctl_names[] = {
+	[_IOC_NR(NMIMGR_IOC_SET_POLICY)]     = "policy",
+	[_IOC_NR(NMIMGR_IOC_SET_SHADOW)]     = "shadow policy",
+	[_IOC_NR(NMIMGR_IOC_CLEAR_SHADOW)]   = "shadow policy removal",
+	[_IOC_NR(NMIMGR_IOC_PROMOTE_SHADOW)] = "shadow policy promotion",
+};
+
+/* Records copied per CPU hotplug lock hold by NMIMGR_IOC_GET_EVENTS */
+#define NMIMGR_CTL_CHUNK 64
+
+static long nmimgr_ctl_cpus_stats(struct nmimgr_cpus_stats __user *ureq)
+{
+	struct nmimgr_cpus_stats req;
+	struct nmimgr_cpu_stats *cs;
+	struct nmimgr_cpu_stats __user *ucs;
+	unsigned int done = 0;
+	long ret = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	ucs = (struct nmimgr_cpu_stats __user *)(unsigned long)req.stats;
+
+	cs = kzalloc(sizeof(*cs), GFP_KERNEL);
+	if (!cs)
+		return -ENOMEM;
+
+	for (; done < req.nr && req.cpu < nr_cpu_ids; req.cpu++) {
+		if (!cpu_possible(req.cpu))
+			continue;
+		cs->cpu = req.cpu;
+		memcpy(&cs->stats, per_cpu_ptr(nmimgr_stats, req.cpu),
+			sizeof(cs->stats));
+		if (copy_to_user(&ucs[done], cs, sizeof(*cs))) {
+			ret = -EFAULT;
+			break;
+		}
+		done++;
+	}
+	kfree(cs);
+
+	req.nr = done;
+	if (!ret && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+	return ret;
+}
+
+/**
+ * Copy the records of a CPU ring from req.seq on. The ring is only held
+ * (against the hotplug teardown) while copying a chunk to a buffer
+ */
+static long nmimgr_ctl_events(struct nmimgr_events_read __user *ureq)
+{
+	struct nmimgr_events_read req;
+	struct nmimgr_event *buf;
+	struct nmimgr_event __user *uev;
+	struct nmimgr_ring *ring;
+	unsigned int n, done = 0;
+	u64 head;
+	long ret = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (req.cpu >= nr_cpu_ids || !cpu_possible(req.cpu))
+		return -ENOENT;
+	uev = (struct nmimgr_event __user *)(unsigned long)req.events;
+
+	buf = kmalloc(NMIMGR_CTL_CHUNK * sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	req.head = 0;
+	while (done < req.nr) {
+		cpus_read_lock();
+		ring = per_cpu(nmimgr_ring, req.cpu);
+		if (!ring) {
+			cpus_read_unlock();
+			if (!done)
+				ret = -ENOENT;
+			break;
+		}
+
+		head = READ_ONCE(ring->head);
+		if (head > ring_size && req.seq < head - ring_size)
+			req.seq = head - ring_size;
+		for (n = 0; n < NMIMGR_CTL_CHUNK && done + n < req.nr &&
+		     req.seq < head; req.seq++) {
+			buf[n] = ring->ev[req.seq & nmimgr_ring_mask];
+			/* Overwritten while we were reading */
+			if (buf[n].seq == (u32)req.seq)
+				n++;
+		}
+		req.head = head;
+		cpus_read_unlock();
+
+		if (!n)
+			break;
+		if (copy_to_user(&uev[done], buf, n * sizeof(*buf))) {
+			ret = -EFAULT;
+			break;
+		}
+		done += n;
+	}
+	kfree(buf);
+
+	req.nr = done;
+	if (!ret && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+	return ret;
+}
+
+static long nmimgr_ctl_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	void __user *uarg = (void __user *)arg;
+	struct nmimgr_policies *pols;
+	struct nmimgr_policy *pol = NULL;
+	struct nmimgr_cpu_stats __user *cstats;
+	struct nmimgr_stats *sum;
+	unsigned int cpu;
+	long ret = 0;
+
+	switch (cmd) {
+	case NMIMGR_IOC_SET_POLICY:
+	case NMIMGR_IOC_SET_SHADOW:
+	case NMIMGR_IOC_CLEAR_SHADOW:
+	case NMIMGR_IOC_PROMOTE_SHADOW:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		if (_IOC_DIR(cmd) & _IOC_WRITE) {
+			pol = kmalloc(sizeof(*pol), GFP_KERNEL);
+			if (!pol)
+				return -ENOMEM;
+			if (copy_from_user(pol, uarg, sizeof(*pol)))
+				ret = -EFAULT;
+			else if (nmimgr_policy_check(pol))
+				ret = -EINVAL;
+		}
+
+		if (!ret)
+			ret = nmimgr_policy_update(cmd, pol);
+		kfree(pol);
+
+		if (!ret)
+			pr_notice(NMIMGR_NAME": New %s by %s[%d]\n",
+				nmimgr_ctl_names[_IOC_NR(cmd)], current->comm,
+				current->pid);
+		return ret;
+
+	case NMIMGR_IOC_GET_POLICY:
+	case NMIMGR_IOC_GET_SHADOW:
+		mutex_lock(&nmimgr_policy_lock);
+		pols = rcu_dereference_protected(nmimgr_live,
+			lockdep_is_held(&nmimgr_policy_lock));
+		if (cmd == NMIMGR_IOC_GET_POLICY)
+			pol = &pols->live;
+		else if (pols->has_shadow)
+			pol = &pols->shadow;
+
+		if (!pol)
+			ret = -ENOENT;
+		else if (copy_to_user(uarg, pol, sizeof(*pol)))
+			ret = -EFAULT;
+		mutex_unlock(&nmimgr_policy_lock);
+		return ret;
+
+	case NMIMGR_IOC_GET_STATS:
+		sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+		if (!sum)
+			return -ENOMEM;
+		nmimgr_stats_sum(sum);
+		if (copy_to_user(uarg, sum, sizeof(*sum)))
+			ret = -EFAULT;
+		kfree(sum);
+		return ret;
+
+	case NMIMGR_IOC_GET_CPU_STATS:
+		cstats = uarg;
+		if (get_user(cpu, &cstats->cpu))
+			return -EFAULT;
+		if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+			return -ENOENT;
+
+		sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+		if (!sum)
+			return -ENOMEM;
+		memcpy(sum, per_cpu_ptr(nmimgr_stats, cpu), sizeof(*sum));
+		if (copy_to_user(&cstats->stats, sum, sizeof(*sum)))
+			ret = -EFAULT;
+		kfree(sum);
+		return ret;
+
+	case NMIMGR_IOC_GET_CPUS_STATS:
+		return nmimgr_ctl_cpus_stats(uarg);
+
+	case NMIMGR_IOC_GET_EVENTS:
+		return nmimgr_ctl_events(uarg);
+	}
+
+	return -ENOTTY;
+}
+
+static const struct file_operations nmimgr_ctl_fops = {
+	.owner          = THIS_MODULE,
+	.unlocked_ioctl = nmimgr_ctl_ioctl,
+	.compat_ioctl   = nmimgr_ctl_ioctl,
+	.llseek         = noop_llseek,
+};
+
+static struct miscdevice nmimgr_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name  = NMIMGR_NAME,
+	.fops  = &nmimgr_ctl_fops,
+	.mode  = 0600,
+};
+
+static bool nmimgr_ctl_registered;
+
+static void __init nmimgr_ctl_init(void)
+{
+	if (misc_register(&nmimgr_ctl)) {
+		pr_warn(NMIMGR_NAME": Unable to create /dev/"NMIMGR_NAME"\n");
+		return;
+	}
+	nmimgr_ctl_registered = true;
+}
+
+/**
+ * After the handlers are gone: the live policy can be freed right away
+ */
+static void nmimgr_ctl_exit(void)
+{
+	struct nmimgr_policies *pol;
+
+	if (nmimgr_ctl_registered)
+		misc_deregister(&nmimgr_ctl);
+
+	pol = rcu_dereference_protected(nmimgr_live, 1);
+	RCU_INIT_POINTER(nmimgr_live, &nmimgr_policy);
+	if (pol != &nmimgr_policy)
+		kfree(pol);
+}
+
+
+/***** Staged policy (configfs) **********************************************/
+#if (defined(CONFIG_CONFIGFS_FS) || defined(CONFIG_CONFIGFS_FS_MODULE)) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0) && !defined(NMIMGR_BAKED)
+
+/*
+ * Rules are written in /sys/kernel/config/nmimgr/staging, then compiled and
+ * swapped in as one table by writing 1 to commit:
+ *   staging/<type>/<op>       LIST of the op, for this NMI type
+ *   staging/sample            RATE@LIST;... as events_sample
+ *   staging/escalate_window   as the parameter
+ *   generation                of the live policy, as in the events
+ */
+
+/* Same order as NMI_LOCAL .. NMI_IO_CHECK */
+static const char *nmimgr_stage_names[NMIMGR_NTYPES] = {
+	"local", "unknown", "serr", "iochk"
+};
+
+struct nmimgr_stage_type {
+	struct config_group group;
+	char *list[OP_MAX];
+};
+
+static struct nmimgr_stage_type nmimgr_stage_type[NMIMGR_NTYPES];
+static struct config_group nmimgr_stage_group;
+static char *nmimgr_stage_sample;
+static unsigned int nmimgr_stage_window;
+/* Staged values, and commits */
+static DEFINE_MUTEX(nmimgr_stage_lock);
+static bool nmimgr_cfg_registered;
+
+static inline struct nmimgr_stage_type *to_nmimgr_stage(struct config_item *item)
+{
+	return container_of(to_config_group(item), struct nmimgr_stage_type,
+		group);
+}
+
+/**
+ * Copy of the written value, up to the newline
+ */
+static char *nmimgr_stage_dup(const char *page)
+{
+	return kstrndup(page, strcspn(page, "\n"), GFP_KERNEL);
+}
+
+static ssize_t __nmimgr_stage_show(struct config_item *item, int op,
+			char *page)
+{
+	struct nmimgr_stage_type *st = to_nmimgr_stage(item);
+	ssize_t len;
+
+	mutex_lock(&nmimgr_stage_lock);
+	len = sprintf(page, "%s\n", st->list[op] ? st->list[op] : "");
+	mutex_unlock(&nmimgr_stage_lock);
+	return len;
+}
+
 /**
- * Handler
+ * Only valid lists are staged, so a commit can only fail on memory
  */
-static int __nmimgr_handle(unsigned int type, unsigned char reason,
-			struct pt_regs *regs)
+static ssize_t __nmimgr_stage_store(struct config_item *item, int op,
+			const char *page, size_t len)
 {
+	struct nmimgr_stage_type *st = to_nmimgr_stage(item);
+	struct nmimgr_policy *pol;
+	const char *err = NULL;
+	char *str;
+	int ret;
+
+	str = nmimgr_stage_dup(page);
+	pol = kmalloc(sizeof(*pol), GFP_KERNEL);
+	if (!str || !pol) {
+		kfree(str);
+		kfree(pol);
+		return -ENOMEM;
+	}
 
-	int i;
-
-	/* ignored NMI */
-	for (i = 1; i < NMIMGR_NBMAX; i++) {
-		if (reason == events_arr[OP_IGNORE][i])
-			return NMI_DONE;
+	nmimgr_policy_init(pol);
+	ret = nmimgr_policy_parse(pol, op, str, &err);
+	kfree(pol);
+	if (ret) {
+		kfree(str);
+		return -EINVAL;
 	}
 
+	mutex_lock(&nmimgr_stage_lock);
+	swap(st->list[op], str);
+	mutex_unlock(&nmimgr_stage_lock);
+	kfree(str);
+	return len;
+}
 
-	pr_notice(NMIMGR_NAME": Handling new NMI type:%u event:0x%02x (%d)\n",
-		type, reason, reason);
+#define NMIMGR_STAGE_OP(name, op)					\
+static ssize_t nmimgr_stage_##name##_show(struct config_item *item,	\
+			char *page)					\
+{									\
+	return __nmimgr_stage_show(item, op, page);			\
+}									\
+static ssize_t nmimgr_stage_##name##_store(struct config_item *item,	\
+			const char *page, size_t len)			\
+{									\
+	return __nmimgr_stage_store(item, op, page, len);		\
+}									\
+CONFIGFS_ATTR(nmimgr_stage_, name)
+
+NMIMGR_STAGE_OP(ignore, OP_IGNORE);
+NMIMGR_STAGE_OP(drop, OP_DROP);
+NMIMGR_STAGE_OP(debug, OP_DEBUG);
+NMIMGR_STAGE_OP(panic, OP_PANIC);
+NMIMGR_STAGE_OP(escalate, OP_ESCALATE);
+
+static struct configfs_attribute *nmimgr_stage_type_attrs[] = {
+	&nmimgr_stage_attr_ignore,
+	&nmimgr_stage_attr_drop,
+	&nmimgr_stage_attr_debug,
+	&nmimgr_stage_attr_panic,
+	&nmimgr_stage_attr_escalate,
+	NULL,
+};
 
-	/* Debugging NMI */
-	for (i = 1; i < NMIMGR_NBMAX; i++ ) {
-		if (reason == events_arr[OP_DEBUG][i]) {
-			pr_notice(NMIMGR_NAME": Debug NMI");
-			__nmimgr_trace(regs);
-		}
-	}
+static struct config_item_type nmimgr_stage_type_type = {
+	.ct_attrs = nmimgr_stage_type_attrs,
+	.ct_owner = THIS_MODULE,
+};
 
+static ssize_t nmimgr_stage_sample_show(struct config_item *item, char *page)
+{
+	ssize_t len;
 
-	/* dropped NMI */
-	for (i = 1; i < NMIMGR_NBMAX; i++) {
+	mutex_lock(&nmimgr_stage_lock);
+	len = sprintf(page, "%s\n",
+		nmimgr_stage_sample ? nmimgr_stage_sample : "");
+	mutex_unlock(&nmimgr_stage_lock);
+	return len;
+}
 
-		if (reason == events_arr[OP_DROP][i]) {
-			pr_notice(NMIMGR_NAME": Drop NMI event:0x%02x (%d)\n",
-				reason, reason);
-			return NMI_HANDLED;
-		}
+static ssize_t nmimgr_stage_sample_store(struct config_item *item,
+			const char *page, size_t len)
+{
+	const char *err = NULL;
+	u16 *rate;
+	char *str;
+	int ret;
+
+	str = nmimgr_stage_dup(page);
+	rate = kcalloc(NMIMGR_NBMAX, sizeof(*rate), GFP_KERNEL);
+	if (!str || !rate) {
+		kfree(str);
+		kfree(rate);
+		return -ENOMEM;
 	}
 
-	/* Panic NMI */
-	for (i = 1; i < NMIMGR_NBMAX; i++) {
-
-		if (reason == events_arr[OP_PANIC][i]) {
-			pr_emerg(NMIMGR_NAME": Panic on Event:0x%02x(%d)\n",
-				reason, reason);
+	ret = nmimgr_sample_parse(rate, str, &err);
+	kfree(rate);
+	if (ret) {
+		kfree(str);
+		return -EINVAL;
+	}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-			nmi_panic(regs, NMIMGR_NAME": Hit explicit panic");
-#else
-			panic(NMIMGR_NAME": Hit explicit panic");
-#endif
+	mutex_lock(&nmimgr_stage_lock);
+	swap(nmimgr_stage_sample, str);
+	mutex_unlock(&nmimgr_stage_lock);
+	kfree(str);
+	return len;
+}
+CONFIGFS_ATTR(nmimgr_stage_, sample);
 
-		}
-	}
+static ssize_t nmimgr_stage_escalate_window_show(struct config_item *item,
+			char *page)
+{
+	return sprintf(page, "%u\n", READ_ONCE(nmimgr_stage_window));
+}
 
-	/* Still there: unmanaged NMI Code. Send to other handlers */
-	pr_notice(NMIMGR_NAME": Unmanaged NMI event:0x%02x (%d), let it pass\n",
-		reason, reason);
+static ssize_t nmimgr_stage_escalate_window_store(struct config_item *item,
+			const char *page, size_t len)
+{
+	unsigned int window;
 
-	return NMI_DONE;
+	if (kstrtouint(page, 0, &window) || nmimgr_check_window(window))
+		return -EINVAL;
+	WRITE_ONCE(nmimgr_stage_window, window);
+	return len;
 }
+CONFIGFS_ATTR(nmimgr_stage_, escalate_window);
 
+static struct configfs_attribute *nmimgr_stage_attrs[] = {
+	&nmimgr_stage_attr_sample,
+	&nmimgr_stage_attr_escalate_window,
+	NULL,
+};
 
+static struct config_item_type nmimgr_stage_group_type = {
+	.ct_attrs = nmimgr_stage_attrs,
+	.ct_owner = THIS_MODULE,
+};
 
+static u32 nmimgr_policy_gen(void)
+{
+	u32 gen;
 
-/***** Kernel < 3.2 **********************************************************/
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 2, 0)
+	rcu_read_lock();
+	gen = rcu_dereference(nmimgr_live)->gen;
+	rcu_read_unlock();
+	return gen;
+}
 
-static int nmimgr_handle(struct notifier_block *nb, unsigned long val,
-			void *data)
+static ssize_t nmimgr_cfg_generation_show(struct config_item *item,
+			char *page)
 {
-	struct die_args *args = (struct die_args *)data;
-	unsigned char reason = args->err;
+	return sprintf(page, "%u\n", nmimgr_policy_gen());
+}
+CONFIGFS_ATTR_RO(nmimgr_cfg_, generation);
 
-	/* Only process NMI cases */
-	switch (val) {
-	case DIE_NMI:
-	case DIE_NMIWATCHDOG:
-	case DIE_NMI_IPI:
-	case DIE_NMIUNKNOWN:
-		return __nmimgr_handle(1, reason, args->regs);
+/**
+ * Compile the staged rules into a new live table. The sampling rates and
+ * the escalation window follow right after the swap: they do not change
+ * the actions of an event
+ */
+static ssize_t nmimgr_cfg_commit_store(struct config_item *item,
+			const char *page, size_t len)
+{
+	struct nmimgr_policy *pol;
+	const char *err = NULL;
+	unsigned int t, op, r;
+	bool commit;
+	u16 *rate;
+	int ret = 0;
 
-	default:
-		break;
+	if (kstrtobool(page, &commit) || !commit)
+		return -EINVAL;
+
+	pol = kmalloc(sizeof(*pol), GFP_KERNEL);
+	rate = kcalloc(NMIMGR_NBMAX, sizeof(*rate), GFP_KERNEL);
+	if (!pol || !rate) {
+		kfree(pol);
+		kfree(rate);
+		return -ENOMEM;
 	}
 
-	return NOTIFY_OK;
+	mutex_lock(&nmimgr_stage_lock);
+	nmimgr_policy_init(pol);
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (op = 0; op < OP_MAX; op++)
+			if (nmimgr_stage_type[t].list[op] &&
+			    nmimgr_policy_parse_types(pol, 1 << t, op,
+					nmimgr_stage_type[t].list[op], &err))
+				ret = -EINVAL;
+	if (nmimgr_stage_sample &&
+	    nmimgr_sample_parse(rate, nmimgr_stage_sample, &err))
+		ret = -EINVAL;
+
+	if (!ret)
+		ret = nmimgr_policy_update(NMIMGR_IOC_SET_POLICY, pol);
+	if (!ret) {
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			WRITE_ONCE(nmimgr_sample[r], rate[r]);
+		WRITE_ONCE(escalate_window, nmimgr_stage_window);
+	}
+	mutex_unlock(&nmimgr_stage_lock);
+
+	kfree(pol);
+	kfree(rate);
+	if (ret)
+		return ret;
+
+	pr_notice(NMIMGR_NAME": New staged policy, generation %u, by %s[%d]\n",
+		nmimgr_policy_gen(), current->comm, current->pid);
+	return len;
 }
+CONFIGFS_ATTR_WO(nmimgr_cfg_, commit);
 
+static struct configfs_attribute *nmimgr_cfg_attrs[] = {
+	&nmimgr_cfg_attr_commit,
+	&nmimgr_cfg_attr_generation,
+	NULL,
+};
 
-static struct notifier_block nmimgr_notifier = {
-	.notifier_call = nmimgr_handle,
-	.priority = 0x7FFFFFFF
+static struct config_item_type nmimgr_cfg_type = {
+	.ct_attrs = nmimgr_cfg_attrs,
+	.ct_owner = THIS_MODULE,
 };
 
+static struct configfs_subsystem nmimgr_cfg = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = NMIMGR_NAME,
+			.ci_type    = &nmimgr_cfg_type,
+		},
+	},
+};
 
 /**
- * Handler registration
+ * Staging starts from the load parameters, for all NMI types
  */
-static int nmimgr_register(void)
+static void __init nmimgr_cfg_stage_params(void)
 {
-	int ret = register_die_notifier(&nmimgr_notifier);
+	char *params[OP_MAX] = {
+		[OP_IGNORE]   = events_ignore,
+		[OP_DROP]     = events_drop,
+		[OP_DEBUG]    = events_debug,
+		[OP_PANIC]    = events_panic,
+		[OP_ESCALATE] = events_escalate,
+	};
+	unsigned int t, op;
+
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (op = 0; op < OP_MAX; op++)
+			if (params[op])
+				nmimgr_stage_type[t].list[op] =
+					kstrdup(params[op], GFP_KERNEL);
+	if (events_sample)
+		nmimgr_stage_sample = kstrdup(events_sample, GFP_KERNEL);
+	nmimgr_stage_window = escalate_window;
+}
 
-	if (ret) {
-		pr_warn(NMIMGR_NAME": Unable to register NMI handler\n");
-		return ret;
-	}
+static void nmimgr_cfg_free(void)
+{
+	unsigned int t, op;
 
-	pr_notice(NMIMGR_NAME": Registered handler\n");
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (op = 0; op < OP_MAX; op++)
+			kfree(nmimgr_stage_type[t].list[op]);
+	kfree(nmimgr_stage_sample);
+}
 
-	return 0;
+static void __init nmimgr_cfg_init(void)
+{
+	unsigned int t;
+
+	config_group_init(&nmimgr_cfg.su_group);
+	mutex_init(&nmimgr_cfg.su_mutex);
+
+	config_group_init_type_name(&nmimgr_stage_group, "staging",
+		&nmimgr_stage_group_type);
+	configfs_add_default_group(&nmimgr_stage_group, &nmimgr_cfg.su_group);
+	for (t = 0; t < NMIMGR_NTYPES; t++) {
+		config_group_init_type_name(&nmimgr_stage_type[t].group,
+			nmimgr_stage_names[t], &nmimgr_stage_type_type);
+		configfs_add_default_group(&nmimgr_stage_type[t].group,
+			&nmimgr_stage_group);
+	}
+	nmimgr_cfg_stage_params();
+
+	if (configfs_register_subsystem(&nmimgr_cfg)) {
+		pr_warn(NMIMGR_NAME": Unable to register in configfs\n");
+		nmimgr_cfg_free();
+		return;
+	}
+	nmimgr_cfg_registered = true;
 }
 
 /**
- * Handler unregistration
+ * Before the control device exit, which resets the live policy
  */
-static void nmimgr_unregister(void)
+static void nmimgr_cfg_exit(void)
 {
-	unregister_die_notifier(&nmimgr_notifier);
+	if (!nmimgr_cfg_registered)
+		return;
+	configfs_unregister_subsystem(&nmimgr_cfg);
+	nmimgr_cfg_free();
 }
 
-/***** Kernel 3.2+ ***********************************************************/
 #else
+static void __init nmimgr_cfg_init(void)
+{
+}
 
-static int nmimgr_handle(unsigned int type, struct pt_regs *regs)
+static void nmimgr_cfg_exit(void)
 {
-	return __nmimgr_handle(type, x86_platform.get_nmi_reason(), regs);
 }
+#endif
 
 
+/***** Per-cpu buffers *******************************************************/
 
-/**
- * handler registration
- */
-static int nmimgr_register(void)
+static int __init nmimgr_percpu_init(void)
 {
-	int ret = 0;
-	int i;
-
-	/* A loop wont work because of Macro rewriting of
-	 * register_nmi_handler (https://lkml.org/lkml/2012/3/8/386)
-	 */
-
-	/* We register our handler first, as we only manage a specific list */
-	ret = register_nmi_handler(
-	    NMI_UNKNOWN, nmimgr_handle, NMI_FLAG_FIRST, NMIMGR_NAME);
-	if (ret) {
-		pr_warn(NMIMGR_NAME ": Unable to register NMI_UNKNOWN\n");
-		i = NMI_UNKNOWN-1;
-		goto err;
-	}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
-	ret = register_nmi_handler(
-		NMI_SERR, nmimgr_handle, NMI_FLAG_FIRST, NMIMGR_NAME);
-	if (ret) {
-		pr_warn(NMIMGR_NAME ": Unable to register NMI_SERR\n");
-		i = NMI_SERR-1;
-		goto err;
-	}
-	ret = register_nmi_handler(
-		NMI_IO_CHECK, nmimgr_handle, NMI_FLAG_FIRST, NMIMGR_NAME);
-	if (ret) {
-		pr_warn(NMIMGR_NAME ": Unable to register NMI_IO_CHECK\n");
-		i = NMI_IO_CHECK-1;
-		goto err;
+	nmimgr_stats = alloc_percpu(struct nmimgr_stats);
+	nmimgr_sample_cpu = alloc_percpu(struct nmimgr_sample_cpu);
+	if (!nmimgr_stats || !nmimgr_sample_cpu) {
+		free_percpu(nmimgr_stats);
+		free_percpu(nmimgr_sample_cpu);
+		return -ENOMEM;
 	}
-#endif
-
-
 	return 0;
+}
 
-err:
-	for (; i > 0; i--)
-		unregister_nmi_handler(i, NMIMGR_NAME);
+static void nmimgr_percpu_exit(void)
+{
+	free_percpu(nmimgr_stats);
+	free_percpu(nmimgr_sample_cpu);
+}
 
-	return ret;
+static size_t nmimgr_cpu_bytes(void)
+{
+	return sizeof(struct nmimgr_ring) +
+		ring_size * sizeof(struct nmimgr_event) +
+		sizeof(struct nmimgr_bt) + sizeof(struct nmimgr_rate);
 }
 
 /**
- * Handler unregistration
+ * Allocate the ring, snapshot and rate buffers of a CPU on its node, before
+ * it can take an NMI. Failing only disables the recording on this CPU
  */
-static void nmimgr_unregister(void)
+static int nmimgr_cpu_prepare(unsigned int cpu)
 {
-	int i;
-
-	for (i = NMI_MAX-1; i > NMI_LOCAL; i--)
-		unregister_nmi_handler(i, NMIMGR_NAME);
+	int node = cpu_to_node(cpu);
+	struct nmimgr_ring *ring;
+	struct nmimgr_bt *bt;
+	struct nmimgr_rate *rate;
+
+	ring = kzalloc_node(sizeof(*ring) + ring_size * sizeof(ring->ev[0]),
+		GFP_KERNEL, node);
+	bt = kzalloc_node(sizeof(*bt), GFP_KERNEL, node);
+	rate = kzalloc_node(sizeof(*rate), GFP_KERNEL, node);
+	if (!ring || !bt || !rate) {
+		pr_warn(NMIMGR_NAME": No memory for cpu %u buffers\n", cpu);
+		kfree(ring);
+		kfree(bt);
+		kfree(rate);
+		return 0;
+	}
 
+	per_cpu(nmimgr_bt, cpu) = bt;
+	per_cpu(nmimgr_rate, cpu) = rate;
+	smp_wmb();
+	per_cpu(nmimgr_ring, cpu) = ring;
+	return 0;
 }
 
-#endif
+/**
+ * The CPU is dead when called, so it is not in its NMI handler
+ */
+static int nmimgr_cpu_dead(unsigned int cpu)
+{
+	struct nmimgr_ring *ring = per_cpu(nmimgr_ring, cpu);
+	struct nmimgr_bt *bt = per_cpu(nmimgr_bt, cpu);
+	struct nmimgr_rate *rate = per_cpu(nmimgr_rate, cpu);
+
+	per_cpu(nmimgr_ring, cpu) = NULL;
+	per_cpu(nmimgr_bt, cpu) = NULL;
+	per_cpu(nmimgr_rate, cpu) = NULL;
+	kfree(ring);
+	kfree(bt);
+	kfree(rate);
+	return 0;
+}
 
-/*****************************************************************************/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+static enum cpuhp_state nmimgr_cpuhp;
 
-static int __init __nmimgr_setup(int op, char *str)
+static int __init nmimgr_cpu_init(void)
 {
-	char *ret = 0;
-
-	if (!str)
-		return 1;
+	int ret;
 
-	/* lib/cmdline.c: Extract int list from str into events_panic_list[] */
-	ret = get_options(str, ARRAY_SIZE(events_arr[op]),
-		events_arr[op]);
+	ret = cpuhp_setup_state(CPUHP_BP_PREPARE_DYN, NMIMGR_NAME":prepare",
+		nmimgr_cpu_prepare, nmimgr_cpu_dead);
+	if (ret < 0)
+		return ret;
 
-	if (ret && *ret != 0) {
-		pr_err(NMIMGR_NAME": Invalid input '%s', ret:%s\n", str, ret);
-		return 0;
-	}
-	return 1;
+	nmimgr_cpuhp = ret;
+	return 0;
 }
 
+static void nmimgr_cpu_exit(void)
+{
+	cpuhp_remove_state(nmimgr_cpuhp);
+}
 
-/**
- * Parse the input string
- */
-static int __init nmimgr_setup_panic(char *str)
+#else
+/* No dynamic hotplug state: allocate for all possible CPUs */
+static int __init nmimgr_cpu_init(void)
 {
-	if (!str)
-		return 1;
+	unsigned int cpu;
 
-	pr_info(NMIMGR_NAME ": events_panic: %s\n", str);
-	return __nmimgr_setup(OP_PANIC, str);
+	for_each_possible_cpu(cpu)
+		nmimgr_cpu_prepare(cpu);
+	return 0;
 }
-__setup("nmimgr.events_panic=", nmimgr_setup_panic);
 
+static void nmimgr_cpu_exit(void)
+{
+	unsigned int cpu;
 
-/**
- *
- */
-static int __init nmimgr_setup_debug(char *str)
+	for_each_possible_cpu(cpu)
+		nmimgr_cpu_dead(cpu);
+}
+#endif
+
+static void __init nmimgr_cpu_report(void)
 {
-	if (!str)
-		return 1;
+	unsigned int cpu, nr = 0;
 
-	pr_info(NMIMGR_NAME ": events_debug: %s\n", str);
-	return __nmimgr_setup(OP_DEBUG, str);
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(nmimgr_ring, cpu))
+			nr++;
+	}
+
+	pr_info(NMIMGR_NAME": %u events per cpu, %zu bytes per cpu, %zu KiB "
+		"for %u cpus\n", ring_size, nmimgr_cpu_bytes(),
+		nr * nmimgr_cpu_bytes() / 1024, nr);
 }
-__setup("nmimgr.events_debug=", nmimgr_setup_debug);
 
 
 /**
- *
+ * Publish nmimgr_crashinfo in vmcoreinfo, so it is in the vmcore ELF notes.
+ * vmcoreinfo_append_str is not exported. From 4.13, once kdump is loaded,
+ * the kernel only writes a copy made at load time, so refresh that copy
+ * too: its address is a data symbol, only there with CONFIG_KALLSYMS_ALL.
+ * The address is also logged, for nmimgr-drgn.py -a when neither works.
  */
-static int __init nmimgr_setup_ignore(char *str)
+static void __init nmimgr_crashinfo_register(void)
 {
-	if (!str)
-		return 1;
+	void (*sym_append)(const char *fmt, ...) = NULL;
+#ifdef MODULE
+	void (*sym_safecopy)(void *ptr);
+	unsigned char **sym_safedata;
+#endif
+	struct nmimgr_crashinfo *ci = &nmimgr_crashinfo;
 
-	pr_info(NMIMGR_NAME ": events_ignore: %s\n", str);
-	return __nmimgr_setup(OP_IGNORE, str);
+	ci->version        = NMIMGR_CRASHINFO_VERSION;
+	ci->nr_cpus        = nr_cpu_ids;
+#ifdef CONFIG_SMP
+	ci->per_cpu_offset = (unsigned long)__per_cpu_offset;
+#endif
+	ci->ring           = (unsigned long)&nmimgr_ring;
+	ci->ring_size      = ring_size;
+	ci->event_size     = sizeof(struct nmimgr_event);
+	ci->stats          = (unsigned long)nmimgr_stats;
+	ci->stats_size     = sizeof(struct nmimgr_stats);
+	ci->policy_nbmax   = NMIMGR_NBMAX;
+	ci->policy         = (unsigned long)&nmimgr_policy.live;
+	ci->policy_ntypes  = NMIMGR_NTYPES;
+	ci->bt             = (unsigned long)&nmimgr_bt;
+	ci->bt_size        = sizeof(struct nmimgr_bt);
+	ci->nr_ops         = OP_MAX;
+	ci->depot          = (unsigned long)nmimgr_depot;
+	ci->depot_size     = NMIMGR_DEPOT_SIZE;
+	ci->stack_size     = sizeof(struct nmimgr_stack);
+	smp_wmb();
+	ci->magic          = NMIMGR_CRASHINFO_MAGIC;
+
+	pr_info(NMIMGR_NAME": crashinfo at 0x%lx\n", (unsigned long)ci);
+
+#ifdef MODULE
+	sym_append = (void*)nmimgr_lookup_name("vmcoreinfo_append_str");
+	sym_safecopy = (void*)nmimgr_lookup_name(
+		"crash_update_vmcoreinfo_safecopy");
+	sym_safedata = (void*)nmimgr_lookup_name("vmcoreinfo_data_safecopy");
+#elif defined(CONFIG_CRASH_CORE) || defined(CONFIG_KEXEC)
+	sym_append = vmcoreinfo_append_str;
+#endif
+
+	if (!sym_append) {
+		pr_warn(NMIMGR_NAME": vmcoreinfo not available, give the crashinfo "
+			"address to nmimgr-drgn.py -a\n");
+		return;
+	}
+
+	sym_append("NMIMGR=%lx\n", (unsigned long)ci);
+
+	/* Built in, we are there before kdump is loaded */
+#if defined(MODULE) && LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	if (sym_safecopy && sym_safedata) {
+		/* NULL until kdump is loaded, which then copies our entry */
+		if (*sym_safedata)
+			sym_safecopy(*sym_safedata);
+		return;
+	}
+	pr_warn(NMIMGR_NAME": Unable to refresh the kdump copy of vmcoreinfo "
+		"(needs CONFIG_KALLSYMS_ALL): if kdump is already loaded, reload "
+		"it, or give the crashinfo address to nmimgr-drgn.py -a\n");
+#endif
 }
-__setup("nmimgr.events_ignore=", nmimgr_setup_ignore);
 
 /**
- *
+ * The vmcoreinfo line cannot be removed, invalidate what it points to
  */
-static int __init nmimgr_setup_drop(char *str)
+static void nmimgr_crashinfo_unregister(void)
 {
-	if (!str)
-		return 1;
-
-	pr_info(NMIMGR_NAME ": events_drop: %s\n", str);
-	return __nmimgr_setup(OP_DROP, str);
+	nmimgr_crashinfo.magic = 0;
 }
-__setup("nmimgr.events_drop=", nmimgr_setup_drop);
-
 
 
 /**
@@ -359,16 +3712,82 @@ int __init init_module(void)
 
 	pr_notice(NMIMGR_NAME ": Loaded module v%s\n", NMIMGR_VERSION);
 
+#ifdef NMIMGR_BAKED
+	pr_info(NMIMGR_NAME": Policy baked at build time\n");
+#else
 	nmimgr_setup_ignore(events_ignore);
 	nmimgr_setup_debug(events_debug);
 	nmimgr_setup_panic(events_panic);
 	nmimgr_setup_drop(events_drop);
+	nmimgr_setup_escalate(events_escalate);
+#endif
+	nmimgr_setup_unclaimed_drop(unclaimed_drop);
+	nmimgr_setup_unclaimed_debug(unclaimed_debug);
+	nmimgr_setup_unclaimed_panic(unclaimed_panic);
+	nmimgr_setup_sample(events_sample);
+
+	if (drop_mode && !strcmp(drop_mode, "ack"))
+		nmimgr_drop_ack = true;
+	else if (drop_mode && strcmp(drop_mode, "pass"))
+		pr_err(NMIMGR_NAME": Invalid drop_mode '%s'\n", drop_mode);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 2, 0)
+	/* The die notifier runs without the reason port lock */
+	if (nmimgr_drop_ack) {
+		pr_err(NMIMGR_NAME": drop_mode=ack needs kernel 3.2+\n");
+		nmimgr_drop_ack = false;
+	}
+#endif
+
+	if (ring_size < 2 || ring_size > NMIMGR_RING_MAX) {
+		pr_err(NMIMGR_NAME": Invalid ring_size %u\n", ring_size);
+		ring_size = NMIMGR_RING_SIZE;
+	}
+	ring_size = roundup_pow_of_two(ring_size);
+	nmimgr_ring_mask = ring_size - 1;
+
+	/* Not checked on write before 2.6.39 */
+	if (nmimgr_check_window(escalate_window))
+		escalate_window = NMIMGR_ESCALATE_WINDOW;
+
+	RCU_INIT_POINTER(nmimgr_live, &nmimgr_policy);
+
+	if (selftest && nmimgr_selftest()) {
+		pr_err(NMIMGR_NAME": Self-test failed, not loading\n");
+		return -EINVAL;
+	}
+
+	/* Before the debug action or vmcoreinfo may need it */
+	nmimgr_lookup_init();
+
+	/* Before any NMI can be counted or recorded */
+	err = nmimgr_percpu_init();
+	if (err) {
+		pr_warn(NMIMGR_NAME": Unable to allocate the counters\n");
+		return err;
+	}
+	err = nmimgr_cpu_init();
+	if (err) {
+		pr_warn(NMIMGR_NAME": Unable to allocate the cpu buffers\n");
+		nmimgr_percpu_exit();
+		return err;
+	}
+	nmimgr_cpu_report();
 
 	err = nmimgr_register();
 	if (err) {
 		pr_warn(NMIMGR_NAME": NMI Management not available\n");
+		nmimgr_cpu_exit();
+		nmimgr_percpu_exit();
 		return err;
 	}
+
+	nmimgr_crashinfo_register();
+	nmimgr_prof_init();
+	nmimgr_last_register();
+	nmimgr_pmu_init();
+	nmimgr_debugfs_init();
+	nmimgr_ctl_init();
+	nmimgr_cfg_init();
 	return 0;
 }
 /* module_init(init_module); */
@@ -378,7 +3797,17 @@ int __init init_module(void)
  */
 void __exit clean_module(void)
 {
+	/* Stop injecting before removing the handler */
+	nmimgr_debugfs_exit();
+	nmimgr_pmu_exit();
+	nmimgr_last_unregister();
 	nmimgr_unregister();
+	nmimgr_prof_exit();
+	nmimgr_crashinfo_unregister();
+	nmimgr_cfg_exit();
+	nmimgr_ctl_exit();
+	nmimgr_cpu_exit();
+	nmimgr_percpu_exit();
 	pr_notice(NMIMGR_NAME": unloaded module\n");
 }
 
@@ -395,6 +3824,7 @@ MODULE_LICENSE("GPL");
 MODULE_VERSION(NMIMGR_VERSION);
 
 /* Parameters */
+#ifndef NMIMGR_BAKED
 module_param(events_panic, charp, 0444);
 MODULE_PARM_DESC(events_panic, "List of NMIs to panic upon receiving");
 
@@ -406,3 +3836,60 @@ MODULE_PARM_DESC(events_ignore, "List of NMIs to ignore silently");
 
 module_param(events_drop, charp, 0444);
 MODULE_PARM_DESC(events_drop, "List of NMIs to hide from other handlers");
+
+module_param(events_escalate, charp, 0444);
+MODULE_PARM_DESC(events_escalate, "List of NMIs to capture all CPUs upon "
+	"receiving, and to panic upon receiving again");
+#endif
+
+module_param(test_mode, bool, 0644);
+MODULE_PARM_DESC(test_mode, "Count panics instead of doing them");
+
+module_param(profile_handlers, bool, 0444);
+MODULE_PARM_DESC(profile_handlers, "Time every NMI handler of the system, "
+	"through the nmi_handler tracepoint");
+
+module_param(drop_mode, charp, 0444);
+MODULE_PARM_DESC(drop_mode, "pass (default) or ack: clear and re-arm "
+	"SERR/IOCHK after dropping them");
+
+module_param(budget_us, uint, 0644);
+MODULE_PARM_DESC(budget_us, "Time allowed to the debug action, in us "
+	"(0: no limit)");
+
+module_param(budget_strikes, uint, 0644);
+MODULE_PARM_DESC(budget_strikes, "Consecutive debug actions over budget_us "
+	"to degrade it: full, raw capture, count only (default 3)");
+
+module_param(catch_unclaimed, bool, 0444);
+MODULE_PARM_DESC(catch_unclaimed, "Add a last handler to count the NMIs "
+	"we passed and nobody claimed (3.15+)");
+
+module_param(unclaimed_drop, charp, 0444);
+MODULE_PARM_DESC(unclaimed_drop, "List of unclaimed NMIs to claim anyway");
+
+module_param(unclaimed_debug, charp, 0444);
+MODULE_PARM_DESC(unclaimed_debug, "List of unclaimed NMIs to show debug for");
+
+module_param(unclaimed_panic, charp, 0444);
+MODULE_PARM_DESC(unclaimed_panic, "List of unclaimed NMIs to panic upon");
+
+module_param(events_sample, charp, 0444);
+MODULE_PARM_DESC(events_sample, "RATE@LIST;...: only record 1 in RATE of "
+	"these events (the counters stay exact)");
+
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Events kept per cpu, rounded up to a power "
+	"of 2 (def: 64)");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+module_param_cb(escalate_window, &nmimgr_window_ops, &escalate_window, 0644);
+#else
+module_param(escalate_window, uint, 0644);
+#endif
+MODULE_PARM_DESC(escalate_window, "Delay in ms for a second NMI to panic "
+	"after an escalation, over 1000 (default 60000)");
+
+module_param(selftest, bool, 0444);
+MODULE_PARM_DESC(selftest, "Check the policy compiler, the decisions and "
+	"their cost before loading");
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Structures shared between the module and the tools reading its state,
+ * either live or from a vmcore. Only fixed-size types here.
+ */
+
+#ifndef _NMIMGR_H
+#define _NMIMGR_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define NMIMGR_NAME     "nmimgr"
+#define NMIMGR_NBMAX    256
+#define NMIMGR_NTYPES   4       /* NMI_LOCAL .. NMI_IO_CHECK */
+
+enum {
+	OP_IGNORE=0,
+	OP_DROP,
+	OP_DEBUG,
+	OP_PANIC,
+	OP_ESCALATE,
+	OP_MAX
+};
+
+/**
+ * Compiled policy: what to do for each NMI type and event code. This is
+ * also the binary format uploaded with NMIMGR_IOC_SET_POLICY
+ */
+#define NMIMGR_POLICY_MAGIC    0x4c4f504dU      /* "MPOL" */
+#define NMIMGR_POLICY_VERSION  1
+
+struct nmimgr_policy {
+	__u32 magic;
+	__u32 version;
+	__u8  act[NMIMGR_NTYPES][NMIMGR_NBMAX];  /* Bitmask of (1 << OP_*) */
+};
+
+/* Default and max events kept per CPU, the size is a power of 2 */
+#define NMIMGR_RING_SIZE 64
+#define NMIMGR_RING_MAX  65536
+
+/**
+ * Handled NMIs, as recorded in the per-cpu ring. Identical consecutive
+ * events are coalesced in one record, and sampled reasons only record 1 in
+ * N events: count is the number of NMIs this record stands for.
+ */
+struct nmimgr_event {
+	__u64 ts;       /* local_clock() in ns, of the first NMI */
+	__u64 last;     /* local_clock() in ns, of the last NMI */
+	__u32 seq;      /* per-cpu sequence number */
+	__u32 count;
+	__u16 cpu;
+	__u8  type;     /* NMI_UNKNOWN, NMI_SERR... */
+	__u8  reason;   /* Value read from the NMI reason port */
+	__u8  ops;      /* Bitmask of (1 << OP_*) applied, 0 if unmanaged */
+	__u8  flags;    /* NMIMGR_EV_* */
+	__u16 gen;      /* Low bits of the policy generation that classified it */
+	__u32 ref;      /* UNCLAIMED: seq of the first stage event, or ~0 */
+	__u32 stack;    /* Depot handle of the debug stack, 0 if none */
+	/* Interrupted context, of the last NMI */
+	__u64 ip;
+	__u32 pid;      /* 0 for the idle task */
+	__u32 preempt;  /* preempt_count(), without the NMI */
+	char  comm[16];
+	__u32 ctx;      /* NMIMGR_CTX_* */
+	__u32 pad;
+};
+
+/* Recorded by the terminal handler: nobody claimed this NMI */
+#define NMIMGR_EV_UNCLAIMED  0x01
+
+/* Interrupted in user mode */
+#define NMIMGR_CTX_USER      0x01
+/* Interrupted with IRQs disabled */
+#define NMIMGR_CTX_IRQOFF    0x02
+
+/**
+ * Per-cpu ring, only written by its own CPU
+ */
+struct nmimgr_ring {
+	__u64 head;     /* Total events written, next slot is head % size */
+	struct nmimgr_event ev[];       /* crashinfo ring_size entries */
+};
+
+/* Frames kept for each CPU on a staged escalation */
+#define NMIMGR_BT_DEPTH 32
+
+/**
+ * Per-cpu snapshot taken on the first stage of an escalation
+ */
+struct nmimgr_bt {
+	__u64 ts;       /* 0 if never captured */
+	__u64 ip;       /* Interrupted instruction */
+	__u32 pid;
+	__u32 nr;       /* Valid entries */
+	char  comm[16];
+	__u64 entries[NMIMGR_BT_DEPTH];
+};
+
+/* Stacks kept by the depot, must be a power of 2 */
+#define NMIMGR_DEPOT_SIZE  1024
+#define NMIMGR_STACK_BUSY  0xffffffffU
+
+/**
+ * Stack depot entry: each distinct debug stack is stored once, events
+ * refer to it by handle (index + 1)
+ */
+struct nmimgr_stack {
+	__u32 hash;
+	__u32 nr;       /* Valid entries, 0 if free or NMIMGR_STACK_BUSY */
+	__u64 hits;
+	__u64 ts;       /* First capture */
+	__u64 entries[NMIMGR_BT_DEPTH];
+};
+
+/**
+ * Per-cpu counters
+ */
+struct nmimgr_stats {
+	__u64 seen;
+	__u64 ops[OP_MAX];
+	__u64 unmanaged;
+	__u64 reason[NMIMGR_NBMAX];
+	__u64 test_panic;       /* Panics skipped by test_mode */
+	__u64 local_skipped;    /* Pre-3.2: watchdog NMIs passed */
+	__u64 ack_serr;         /* drop_mode=ack: SERR latch cleared */
+	__u64 ack_iochk;        /* drop_mode=ack: IOCHK latch cleared */
+	__u64 refire;           /* SERR/IOCHK dropped again within 1ms */
+	__u64 overbudget;       /* Debug actions longer than budget_us */
+	__u64 degraded;         /* Debug actions degraded to a cheaper one */
+	__u64 claimed_later;    /* Passed by us, claimed by another handler */
+	__u64 unclaimed;        /* Passed by us, claimed by nobody */
+	__u64 unclaimed_reason[NMIMGR_NBMAX];
+	__u64 sampled;          /* Events not recorded by events_sample */
+	__u64 coalesced;        /* Events merged in the previous record */
+	__u64 depot_full;       /* Debug stacks the depot had no room for */
+	__u64 handler_ns;       /* Time spent handling NMIs */
+	__u64 shadow_ops[OP_MAX];       /* Actions the shadow policy took */
+	__u64 shadow_diff[NMIMGR_NBMAX]; /* Shadow and live policies differ */
+	__u64 shadow_reason[NMIMGR_NBMAX][OP_MAX];  /* shadow_ops per reason */
+};
+
+/*
+ * Descriptor exported in vmcoreinfo as "NMIMGR=<addr>", so a dump analyzer
+ * finds every nmimgr structure without symbols. Per-cpu addresses are to be
+ * added to the per_cpu_offset[cpu] entry. The ring and bt per-cpu variables
+ * are pointers, NULL for CPUs offline.
+ */
+#define NMIMGR_CRASHINFO_MAGIC   0x31524d494d4e4d4eULL  /* "NMNMIMR1" */
+#define NMIMGR_CRASHINFO_VERSION 7       /* 7: event context */
+
+struct nmimgr_crashinfo {
+	__u64 magic;
+	__u32 version;
+	__u32 nr_cpus;
+	__u64 per_cpu_offset;   /* Address of __per_cpu_offset[] */
+	__u64 ring;             /* Per-cpu address of struct nmimgr_ring * */
+	__u32 ring_size;
+	__u32 event_size;
+	__u64 stats;            /* Per-cpu address of struct nmimgr_stats */
+	__u32 stats_size;
+	__u32 policy_nbmax;
+	__u64 policy;           /* Address of the live struct nmimgr_policy */
+	__u64 bt;               /* Per-cpu address of struct nmimgr_bt * */
+	__u32 bt_size;
+	__u32 nr_ops;
+	__u64 depot;            /* Address of struct nmimgr_stack[] */
+	__u32 depot_size;
+	__u32 stack_size;
+	__u32 policy_ntypes;
+	__u32 pad;
+};
+
+/**
+ * Counters of one CPU, for NMIMGR_IOC_GET_CPU_STATS: cpu is set by the
+ * caller
+ */
+struct nmimgr_cpu_stats {
+	__u32 cpu;
+	__u32 pad;
+	struct nmimgr_stats stats;
+};
+
+/**
+ * Counters of several CPUs, for NMIMGR_IOC_GET_CPUS_STATS: from cpu on,
+ * up to nr entries are written in stats. On return, nr is the number of
+ * entries written and cpu the next one to ask for, nr_cpu_ids at the end
+ */
+struct nmimgr_cpus_stats {
+	__u32 cpu;
+	__u32 nr;
+	__u64 stats;    /* Address of struct nmimgr_cpu_stats[nr] */
+};
+
+/**
+ * Records of one CPU ring, for NMIMGR_IOC_GET_EVENTS: from the one of
+ * sequence seq on (or the oldest still there), up to nr records are
+ * written in events. On return, nr is the number of records written, seq
+ * the one to ask for next and head the records written so far in the ring
+ */
+struct nmimgr_events_read {
+	__u32 cpu;
+	__u32 nr;
+	__u64 seq;
+	__u64 head;
+	__u64 events;   /* Address of struct nmimgr_event[nr] */
+};
+
+/*
+ * Control device /dev/nmimgr. SET_POLICY replaces the whole live policy,
+ * atomically for the NMI handler. GET_STATS sums the per-cpu counters,
+ * GET_CPU_STATS gives those of one CPU (ENOENT if not possible) and
+ * GET_CPUS_STATS those of many in one call. GET_EVENTS reads a CPU ring
+ * from a sequence number, to only get the records not read yet.
+ * The shadow policy is evaluated with the live one, but only counted in
+ * shadow_*, until PROMOTE_SHADOW makes it the live one.
+ */
+#define NMIMGR_IOC_MAGIC       'N'
+#define NMIMGR_IOC_SET_POLICY  _IOW(NMIMGR_IOC_MAGIC, 1, struct nmimgr_policy)
+#define NMIMGR_IOC_GET_POLICY  _IOR(NMIMGR_IOC_MAGIC, 2, struct nmimgr_policy)
+#define NMIMGR_IOC_GET_STATS   _IOR(NMIMGR_IOC_MAGIC, 3, struct nmimgr_stats)
+#define NMIMGR_IOC_SET_SHADOW  _IOW(NMIMGR_IOC_MAGIC, 4, struct nmimgr_policy)
+#define NMIMGR_IOC_GET_SHADOW  _IOR(NMIMGR_IOC_MAGIC, 5, struct nmimgr_policy)
+#define NMIMGR_IOC_CLEAR_SHADOW    _IO(NMIMGR_IOC_MAGIC, 6)
+#define NMIMGR_IOC_PROMOTE_SHADOW  _IO(NMIMGR_IOC_MAGIC, 7)
+#define NMIMGR_IOC_GET_CPU_STATS  _IOWR(NMIMGR_IOC_MAGIC, 8, \
+					struct nmimgr_cpu_stats)
+#define NMIMGR_IOC_GET_CPUS_STATS _IOWR(NMIMGR_IOC_MAGIC, 9, \
+					struct nmimgr_cpus_stats)
+#define NMIMGR_IOC_GET_EVENTS     _IOWR(NMIMGR_IOC_MAGIC, 10, \
+					struct nmimgr_events_read)
+
+#endif /* _NMIMGR_H */
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Policy compiler, shared by the module and the userspace tools.
+ * Plain C only: no kernel nor libc calls.
+ *
+ * A list is made of comma separated rules:
+ *   N           Event code N
+ *   N-M         Event codes N to M
+ *   MASK:VALUE  Event codes with (code & MASK) == VALUE, eg 0x20:0x20 for
+ *               all codes with bit 5 set
+ * Numbers are decimal, octal (0 prefix) or hex (0x prefix), as get_options()
+ *
+ * Each rule is expanded into nmimgr_policy.act[type][], so the handler only
+ * does one indexed load whatever the rules.
+ *
+ * Sampling rates are given as ';' separated RATE@LIST groups, eg
+ * "100@0x20:0x20;10@5-7" to record 1 in 100 events with bit 5 set and 1 in
+ * 10 events 5 to 7.
+ */
+
+#ifndef _NMIMGR_POLICY_H
+#define _NMIMGR_POLICY_H
+
+#include "nmimgr.h"
+
+static inline int __nmimgr_digit(char c, unsigned int base)
+{
+	unsigned int d;
+
+	if (c >= '0' && c <= '9')
+		d = c - '0';
+	else if (c >= 'a' && c <= 'f')
+		d = c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		d = c - 'A' + 10;
+	else
+		return -1;
+
+	return d < base ? (int)d : -1;
+}
+
+/**
+ * Parse a number up to max.
+ * Returns the char after the number, or NULL if invalid
+ */
+static inline const char *__nmimgr_parse_num(const char *s, unsigned int *val,
+			unsigned int max)
+{
+	unsigned int base = 10;
+	unsigned int v = 0;
+	int d;
+
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		base = 16;
+		s += 2;
+	} else if (s[0] == '0' && s[1] >= '0' && s[1] <= '9') {
+		base = 8;
+		s++;
+	}
+
+	if (__nmimgr_digit(*s, base) < 0)
+		return NULL;
+
+	for (; (d = __nmimgr_digit(*s, base)) >= 0; s++) {
+		v = v * base + d;
+		if (v > max)
+			return NULL;
+	}
+
+	*val = v;
+	return s;
+}
+
+/**
+ * Parse one rule of a list, up to the ',', the end char or the string end.
+ * Returns the start of the next rule or the end, or NULL if invalid.
+ * A plain range is returned with mask NMIMGR_NBMAX-1.
+ */
+static inline const char *__nmimgr_parse_rule(const char *s, char end,
+			unsigned int *lo, unsigned int *hi, unsigned int *mask)
+{
+	s = __nmimgr_parse_num(s, lo, NMIMGR_NBMAX - 1);
+	if (!s)
+		return NULL;
+
+	*hi = *lo;
+	*mask = NMIMGR_NBMAX - 1;
+
+	if (*s == '-') {
+		s = __nmimgr_parse_num(s + 1, hi, NMIMGR_NBMAX - 1);
+		if (!s || *hi < *lo)
+			return NULL;
+	} else if (*s == ':') {
+		*mask = *lo;
+		s = __nmimgr_parse_num(s + 1, lo, NMIMGR_NBMAX - 1);
+		if (!s || (*lo & ~*mask))
+			return NULL;
+		*hi = *lo;
+	}
+
+	if (*s == ',')
+		return s + 1;
+	if (*s && *s != end)
+		return NULL;
+
+	return s;
+}
+
+static inline int __nmimgr_rule_match(unsigned int r, unsigned int lo,
+			unsigned int hi, unsigned int mask)
+{
+	if (mask == NMIMGR_NBMAX - 1)
+		return r >= lo && r <= hi;
+	return (r & mask) == lo;
+}
+
+/**
+ * Empty policy, with its header set
+ */
+static inline void nmimgr_policy_init(struct nmimgr_policy *pol)
+{
+	unsigned int t, r;
+
+	pol->magic   = NMIMGR_POLICY_MAGIC;
+	pol->version = NMIMGR_POLICY_VERSION;
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			pol->act[t][r] = 0;
+}
+
+/**
+ * Check a policy coming from outside. Returns 0 if valid
+ */
+static inline int nmimgr_policy_check(const struct nmimgr_policy *pol)
+{
+	unsigned int t, r;
+
+	if (pol->magic != NMIMGR_POLICY_MAGIC ||
+	    pol->version != NMIMGR_POLICY_VERSION)
+		return -1;
+
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			if (pol->act[t][r] & ~((1 << OP_MAX) - 1))
+				return -1;
+
+	return 0;
+}
+
+/**
+ * Add the rules of str to the action op of the policy, for the NMI types in
+ * the types bitmask (1 << NMI_*).
+ * Returns 0, or -1 with *err set to the start of the invalid rule. The
+ * rules before it are applied.
+ */
+static inline int nmimgr_policy_parse_types(struct nmimgr_policy *pol,
+			unsigned int types, int op, const char *str, const char **err)
+{
+	const char *s = str;
+	unsigned int lo, hi, r, t, mask;
+	unsigned char bit = 1 << op;
+
+	while (*s) {
+		*err = s;
+
+		s = __nmimgr_parse_rule(s, '\0', &lo, &hi, &mask);
+		if (!s)
+			return -1;
+
+		for (r = 0; r < NMIMGR_NBMAX; r++) {
+			if (!__nmimgr_rule_match(r, lo, hi, mask))
+				continue;
+			for (t = 0; t < NMIMGR_NTYPES; t++)
+				if (types & (1 << t))
+					pol->act[t][r] |= bit;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Same, for all NMI types
+ */
+static inline int nmimgr_policy_parse(struct nmimgr_policy *pol, int op,
+			const char *str, const char **err)
+{
+	return nmimgr_policy_parse_types(pol, (1 << NMIMGR_NTYPES) - 1, op,
+		str, err);
+}
+
+/**
+ * Actions the handler does for an act bitmask: ignore alone, otherwise
+ * debug along with the first of drop, escalate and panic. 0 if unmanaged
+ */
+static inline unsigned char nmimgr_policy_decide(unsigned char act)
+{
+	unsigned char debug = act & (1 << OP_DEBUG);
+
+	if (act & (1 << OP_IGNORE))
+		return 1 << OP_IGNORE;
+	if (act & (1 << OP_DROP))
+		return debug | 1 << OP_DROP;
+	if (act & (1 << OP_ESCALATE))
+		return debug | 1 << OP_ESCALATE;
+	if (act & (1 << OP_PANIC))
+		return debug | 1 << OP_PANIC;
+	return debug;
+}
+
+/**
+ * Set the sampling rate of events from RATE@LIST groups. A rate of 0 or 1
+ * records every event.
+ * Returns 0, or -1 with *err set to the start of the invalid group or rule.
+ */
+static inline int nmimgr_sample_parse(__u16 *rate, const char *str,
+			const char **err)
+{
+	const char *s = str;
+	unsigned int n, lo, hi, r, mask;
+
+	while (*s) {
+		*err = s;
+
+		s = __nmimgr_parse_num(s, &n, 0xffff);
+		if (!s || *s != '@' || !s[1])
+			return -1;
+		s++;
+
+		while (*s && *s != ';') {
+			*err = s;
+
+			s = __nmimgr_parse_rule(s, ';', &lo, &hi, &mask);
+			if (!s)
+				return -1;
+
+			for (r = 0; r < NMIMGR_NBMAX; r++)
+				if (__nmimgr_rule_match(r, lo, hi, mask))
+					rate[r] = n;
+		}
+
+		if (*s == ';')
+			s++;
+	}
+
+	return 0;
+}
+
+#endif /* _NMIMGR_POLICY_H */
@@ -20,6 +20,8 @@ typeset NMI_DROP="${NMI_DROP:-}"
 typeset NMI_IGNORE="${NMI_IGNORE:-}"
 typeset HW_VENDOR="${HW_VENDOR:-}"
 typeset HW_MODEL="${HW_MODEL:-}"
+# Replace the policy of the running module: yes, no, or ask (only on a tty)
+typeset NMI_LIVE="${NMI_LIVE:-ask}"
 
 typeset ERR_GUESS=""
 
@@ -50,6 +52,45 @@ function optSetMod {
 	echo "$cfgline" | runroot tee $CFG_MODPROBE >/dev/null
 }
 
+# Apply the values to the running module, without reloading it. This
+# replaces its whole policy (escalate, debug, configfs commits...), so only
+# after showing what changes, and with NMI_LIVE=yes or a yes to the question
+function optSetLive {
+	typeset ctl="$(type -p nmimgrctl)"
+	[[ -z "$ctl" ]] && [[ -x "$MYPATH/tools/nmimgrctl" ]] && ctl="$MYPATH/tools/nmimgrctl"
+	[[ -z "$ctl" ]] && return 1
+	[[ -e "/dev/$KRN_MODNAME" ]] || return 1
+	[[ "$NMI_LIVE" == "no" ]] && return 1
+
+	typeset -a rules=()
+	[[ -n "$NMI_PANIC" ]] && rules+=("panic=$NMI_PANIC")
+	[[ -n "$NMI_DROP" ]] && rules+=("drop=$NMI_DROP")
+	[[ -n "$NMI_IGNORE" ]] && rules+=("ignore=$NMI_IGNORE")
+	[[ ${#rules[@]} -eq 0 ]] && return 1
+
+	typeset changes
+	changes="$(diff -u --label running <(runroot "$ctl" show) \
+		--label guessed <("$ctl" compile "${rules[@]}" | "$ctl" show -))"
+	if [[ $? -eq 0 ]]; then
+		echo "[I] The running module already has this policy"
+		return 0
+	fi
+	echo "[I] Policy of the running module, and the guessed one:"
+	echo "$changes"
+
+	if [[ "$NMI_LIVE" != "yes" ]]; then
+		typeset answer=""
+		[[ -t 0 ]] && read -p "[?] Replace the running policy? [y/N] " answer
+		if [[ "$answer" != [yY]* ]]; then
+			echo "[I] Running policy kept (NMI_LIVE=yes to replace it)"
+			return 1
+		fi
+	fi
+
+	echo "[I] Applying '${rules[*]}' to the running module"
+	runroot "$ctl" set "${rules[@]}"
+}
+
 function optSetCmd {
 
 	typeset cfgline=""
@@ -181,6 +222,8 @@ elif isModAvail && ! isModPluggable; then
 
 fi
 
+optSetLive
+
 
 #
 # Build the module if present here
@@ -0,0 +1,363 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License version 2 as published
+# by the Free Software Foundation.
+#
+# Decode nmimgr state (events, counters, policy) from a vmcore or live kernel
+# using the "NMIMGR=<addr>" line the module adds in vmcoreinfo.
+# No debuginfo needed: layouts are the ones from nmimgr.h
+#
+# Usage:
+#   nmimgr-drgn.py [-a ADDR] [/path/to/vmcore]  (default: /proc/kcore)
+#   drgn -c vmcore nmimgr-drgn.py [-a ADDR]     (uses drgn's "prog")
+#
+# Without a NMIMGR= line (kdump loaded before nmimgr and its copy not
+# refreshed), ADDR is the one of the "nmimgr: crashinfo at" log line. Else
+# the nmimgr_crashinfo symbol or that log line are searched, which needs
+# the debug info.
+#
+
+import struct
+import sys
+
+import drgn
+
+CRASHINFO_MAGIC = 0x31524d494d4e4d4e
+CRASHINFO_VERSION = 7
+OPNAMES = ("ignore", "drop", "debug", "panic", "escalate")
+TYPENAMES = ("local", "unknown", "serr", "iochk")
+
+# struct nmimgr_policy header
+POLICY_FMT = "<II"
+
+# struct nmimgr_crashinfo
+CRASHINFO_FMT = "<QIIQQIIQIIQQIIQIIII"
+CRASHINFO_KEYS = ("magic", "version", "nr_cpus", "per_cpu_offset", "ring",
+                  "ring_size", "event_size", "stats", "stats_size",
+                  "policy_nbmax", "policy", "bt", "bt_size", "nr_ops",
+                  "depot", "depot_size", "stack_size", "policy_ntypes",
+                  "pad")
+
+# struct nmimgr_stats, counters after the per-reason array. Older modules
+# stop earlier: stats_size tells how many are there
+STATS_TAIL = ("test_panic", "local_skipped", "ack_serr", "ack_iochk",
+              "refire", "overbudget", "degraded", "claimed_later",
+              "unclaimed")
+# after the unclaimed_reason array
+STATS_TAIL2 = ("sampled", "coalesced", "depot_full", "handler_ns")
+
+# struct nmimgr_event
+EVENT_FMT = "<QQIIHBBBBHIIQII16sIxxxx"
+EVENT_KEYS = ("ts", "last", "seq", "count", "cpu", "type", "reason", "ops",
+              "flags", "gen", "ref", "stack", "ip", "pid", "preempt", "comm",
+              "ctx")
+EV_UNCLAIMED = 0x01
+CTX_USER = 0x01
+CTX_IRQOFF = 0x02
+
+# struct nmimgr_bt
+BT_FMT = "<QQII16s"
+BT_KEYS = ("ts", "ip", "pid", "nr", "comm")
+
+# struct nmimgr_stack
+STACK_FMT = "<IIQQ"
+STACK_KEYS = ("hash", "nr", "hits", "ts")
+STACK_BUSY = 0xffffffff
+
+
+def elf_vmcoreinfo(path):
+    """Extract the VMCOREINFO note text from an ELF core (vmcore, kcore)"""
+    with open(path, "rb") as f:
+        ehdr = f.read(64)
+        if ehdr[:4] != b"\x7fELF" or ehdr[4] != 2:
+            return None
+        phoff, = struct.unpack_from("<Q", ehdr, 32)
+        phentsize, phnum = struct.unpack_from("<HH", ehdr, 54)
+
+        for i in range(phnum):
+            f.seek(phoff + i * phentsize)
+            ptype, _, off, _, _, filesz = struct.unpack("<IIQQQQ", f.read(40))
+            if ptype != 4:  # PT_NOTE
+                continue
+            f.seek(off)
+            notes = f.read(filesz)
+            pos = 0
+            while pos + 12 <= len(notes):
+                namesz, descsz, _ = struct.unpack_from("<III", notes, pos)
+                pos += 12
+                name = notes[pos:pos + namesz].rstrip(b"\0")
+                pos += (namesz + 3) & ~3
+                desc = notes[pos:pos + descsz]
+                pos += (descsz + 3) & ~3
+                if name == b"VMCOREINFO":
+                    return desc.decode("ascii", "replace")
+    return None
+
+
+def prog_vmcoreinfo(prog):
+    """Read vmcoreinfo from kernel memory, needs vmlinux symbols"""
+    data = prog["vmcoreinfo_data"]
+    size = prog["vmcoreinfo_size"].value_()
+    return prog.read(data.value_(), size).decode("ascii", "replace")
+
+
+def fallback_addrs(prog):
+    """Crashinfo from the module symbol or the load log, with debug info"""
+    addrs = []
+    try:
+        from drgn.helpers.linux.printk import get_printk_records
+        for rec in get_printk_records(prog):
+            text = rec.text.decode("ascii", "replace")
+            if text.startswith("nmimgr: crashinfo at 0x"):
+                addrs.append(int(text.split()[-1], 16))
+    except Exception:
+        pass
+    try:
+        addrs.append(prog.symbol("nmimgr_crashinfo").address)
+    except (LookupError, ValueError):
+        pass
+    return addrs
+
+
+def find_crashinfo(prog, vmcoreinfo, addr=None):
+    """Last NMIMGR= line with a valid magic: the module may have been reloaded"""
+    if addr is not None:
+        addrs = [addr]
+    else:
+        addrs = [int(l.split("=", 1)[1], 16) for l in vmcoreinfo.splitlines()
+                 if l.startswith("NMIMGR=")]
+        if not addrs:
+            addrs = fallback_addrs(prog)
+
+    for addr in reversed(addrs):
+        try:
+            raw = prog.read(addr, struct.calcsize(CRASHINFO_FMT))
+        except drgn.FaultError:
+            continue
+        ci = dict(zip(CRASHINFO_KEYS, struct.unpack(CRASHINFO_FMT, raw)))
+        if ci["magic"] == CRASHINFO_MAGIC:
+            ci["addr"] = addr
+            return ci
+    return None
+
+
+def u64(prog, addr):
+    return struct.unpack("<Q", prog.read(addr, 8))[0]
+
+
+def percpu(prog, ci, addr, cpu):
+    if not ci["per_cpu_offset"]:
+        return addr
+    return addr + u64(prog, ci["per_cpu_offset"] + 8 * cpu)
+
+
+def opsname(ops):
+    names = [n for i, n in enumerate(OPNAMES) if ops & (1 << i)]
+    return "+".join(names) or "pass"
+
+
+def ranges(codes):
+    """Format [1, 2, 3, 7] as 1-3,7"""
+    out = []
+    for c in codes:
+        if out and out[-1][1] == c - 1:
+            out[-1][1] = c
+        else:
+            out.append([c, c])
+    return ",".join("%d-%d" % (a, b) if a != b else str(a) for a, b in out)
+
+
+def dump_policy(prog, ci):
+    nbmax = ci["policy_nbmax"]
+    raw = prog.read(ci["policy"] + struct.calcsize(POLICY_FMT),
+                    ci["policy_ntypes"] * nbmax)
+    acts = [raw[t * nbmax:(t + 1) * nbmax] for t in range(ci["policy_ntypes"])]
+    print("Policy:")
+    for op, name in enumerate(OPNAMES[:ci["nr_ops"]]):
+        lists = [ranges([r for r, a in enumerate(act) if a & (1 << op)])
+                 for act in acts]
+        if all(l == lists[0] for l in lists):
+            print("  %-9s %s" % (name, lists[0]))
+            continue
+        for t, codes in enumerate(lists):
+            if codes:
+                print("  %-9s %s" % (name + "/" + TYPENAMES[t], codes))
+
+
+def dump_stats(prog, ci):
+    nwords = ci["stats_size"] // 8
+    total = [0] * nwords
+    for cpu in range(ci["nr_cpus"]):
+        raw = prog.read(percpu(prog, ci, ci["stats"], cpu), ci["stats_size"])
+        for i, v in enumerate(struct.unpack("<%dQ" % nwords, raw)):
+            total[i] += v
+
+    nops = ci["nr_ops"]
+    nbmax = ci["policy_nbmax"]
+    print("Counters:")
+    print("  seen:      %d" % total[0])
+    for op, name in enumerate(OPNAMES[:nops]):
+        print("  %-10s %d" % (name + ":", total[1 + op]))
+    print("  unmanaged: %d" % total[1 + nops])
+    pos = 2 + nops
+    reasons = total[pos:pos + nbmax]
+    pos += nbmax
+    tail = total[pos:pos + len(STATS_TAIL)]
+    for name, count in zip(STATS_TAIL, tail):
+        print("  %-10s %d" % (name + ":", count))
+    pos += len(STATS_TAIL)
+    unclaimed = total[pos:pos + nbmax]
+    pos += nbmax
+    for name, count in zip(STATS_TAIL2, total[pos:]):
+        print("  %-10s %d" % (name + ":", count))
+    pos += len(STATS_TAIL2)
+    for op, count in enumerate(total[pos:pos + nops]):
+        print("  %-10s %d" % ("shadow_" + OPNAMES[op] + ":", count))
+    pos += nops
+    shadow = total[pos:pos + nbmax]
+    pos += nbmax
+    shadow_reason = total[pos:pos + nbmax * nops]
+    for reason, count in enumerate(reasons):
+        if count:
+            print("  reason 0x%02x: %d" % (reason, count))
+    for reason, count in enumerate(unclaimed):
+        if count:
+            print("  unclaimed 0x%02x: %d" % (reason, count))
+    for reason in range(len(shadow_reason) // nops):
+        counts = shadow_reason[reason * nops:(reason + 1) * nops]
+        if any(counts):
+            print("  shadow_reason 0x%02x: %s" % (reason, " ".join(
+                "%s=%d" % (OPNAMES[op], c) for op, c in enumerate(counts)
+                if c)))
+    for reason, count in enumerate(shadow):
+        if count:
+            print("  shadow 0x%02x: %d" % (reason, count))
+
+
+def dump_events(prog, ci):
+    size = ci["ring_size"]
+    evsize = ci["event_size"]
+    events = []
+
+    for cpu in range(ci["nr_cpus"]):
+        ring = u64(prog, percpu(prog, ci, ci["ring"], cpu))
+        if not ring:
+            continue
+        head = u64(prog, ring)
+        raw = prog.read(ring + 8, size * evsize)
+        for i in range(max(0, head - size), head):
+            off = (i % size) * evsize
+            ev = dict(zip(EVENT_KEYS, struct.unpack_from(EVENT_FMT, raw, off)))
+            if ev["seq"] == i & 0xffffffff:
+                events.append(ev)
+
+    print("Events (%d):" % len(events))
+    for ev in sorted(events, key=lambda e: e["ts"]):
+        extra = ""
+        if ev["count"] > 1:
+            extra += " count=%u last=%d" % (ev["count"], ev["last"])
+        if ev["flags"] & EV_UNCLAIMED:
+            extra += " unclaimed ref=%u" % ev["ref"]
+        if ev["stack"]:
+            extra += " stack=%u" % ev["stack"]
+        extra += " gen=%u pid=%u preempt=0x%x ctx=%s%s comm=%s ip=%s" % (
+            ev["gen"], ev["pid"], ev["preempt"],
+            "user" if ev["ctx"] & CTX_USER else "kernel",
+            ",irqoff" if ev["ctx"] & CTX_IRQOFF else "",
+            ev["comm"].rstrip(b"\0").decode(errors="replace"),
+            symbolize(prog, ev["ip"]))
+        print("  [%5d.%06d] cpu=%u seq=%u type=%u reason=0x%02x ops=%s%s" % (
+            ev["ts"] // 1000000000, ev["ts"] % 1000000000 // 1000,
+            ev["cpu"], ev["seq"], ev["type"], ev["reason"],
+            opsname(ev["ops"]), extra))
+
+
+def symbolize(prog, addr):
+    try:
+        sym = prog.symbol(addr)
+        return "%s+0x%x" % (sym.name, addr - sym.address)
+    except LookupError:
+        return "0x%x" % addr
+
+
+def dump_backtraces(prog, ci):
+    hdrsize = struct.calcsize(BT_FMT)
+    print("Escalation captures:")
+    for cpu in range(ci["nr_cpus"]):
+        addr = u64(prog, percpu(prog, ci, ci["bt"], cpu))
+        if not addr:
+            continue
+        raw = prog.read(addr, ci["bt_size"])
+        bt = dict(zip(BT_KEYS, struct.unpack_from(BT_FMT, raw)))
+        if not bt["ts"]:
+            continue
+        print("  cpu=%d ts=%d pid=%d comm=%s ip=%s" % (
+            cpu, bt["ts"], bt["pid"], bt["comm"].rstrip(b"\0").decode(),
+            symbolize(prog, bt["ip"])))
+        nr = min(bt["nr"], (ci["bt_size"] - hdrsize) // 8)
+        for frame in struct.unpack_from("<%dQ" % nr, raw, hdrsize):
+            print("    %s" % symbolize(prog, frame))
+
+
+def dump_stacks(prog, ci):
+    hdrsize = struct.calcsize(STACK_FMT)
+    raw = prog.read(ci["depot"], ci["depot_size"] * ci["stack_size"])
+    print("Debug stacks:")
+    for i in range(ci["depot_size"]):
+        off = i * ci["stack_size"]
+        st = dict(zip(STACK_KEYS, struct.unpack_from(STACK_FMT, raw, off)))
+        if not st["nr"] or st["nr"] == STACK_BUSY:
+            continue
+        print("  stack=%d hits=%d ts=%d" % (i + 1, st["hits"], st["ts"]))
+        nr = min(st["nr"], (ci["stack_size"] - hdrsize) // 8)
+        for frame in struct.unpack_from("<%dQ" % nr, raw, off + hdrsize):
+            print("    %s" % symbolize(prog, frame))
+
+
+def main(prog, path, addr=None):
+    vmcoreinfo = None
+    if addr is None:
+        vmcoreinfo = elf_vmcoreinfo(path) if path else None
+        if vmcoreinfo is None:
+            vmcoreinfo = prog_vmcoreinfo(prog)
+
+    ci = find_crashinfo(prog, vmcoreinfo, addr)
+    if ci is None:
+        print("nmimgr: no valid crashinfo found, give the address of the "
+              "\"nmimgr: crashinfo at\" log line with -a", file=sys.stderr)
+        return 1
+    if ci["version"] != CRASHINFO_VERSION:
+        print("nmimgr: unknown crashinfo version %d" % ci["version"],
+              file=sys.stderr)
+        return 1
+
+    print("nmimgr crashinfo at 0x%x, %d cpus" % (ci["addr"], ci["nr_cpus"]))
+    dump_policy(prog, ci)
+    dump_stats(prog, ci)
+    dump_events(prog, ci)
+    dump_backtraces(prog, ci)
+    dump_stacks(prog, ci)
+    return 0
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    addr = None
+    if args[:1] == ["-a"] and len(args) > 1:
+        addr = int(args[1], 16)
+        args = args[2:]
+
+    if "prog" in globals():
+        # Running under "drgn -c vmcore script"
+        sys.exit(main(prog, None, addr))  # noqa: F821
+
+    path = args[0] if args else "/proc/kcore"
+    p = drgn.Program()
+    if path == "/proc/kcore":
+        p.set_kernel()
+    else:
+        p.set_core_dump(path)
+    sys.exit(main(p, path, addr))
@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * nmimgr-exporter: serve the nmimgr counters as OpenMetrics, for Prometheus.
+ *
+ * A scrape costs one ioctl per 32 CPUs on /dev/nmimgr for the exact
+ * counters, and one per CPU for the binary records of its events ring
+ * written since the previous scrape (the last one again, as it can still
+ * grow), added to the per-type counters. Nothing is read between scrapes.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "nmimgr.h"
+
+#define NMIMGR_DEV     "/dev/" NMIMGR_NAME
+
+#define DEFAULT_ADDR   "127.0.0.1"
+#define DEFAULT_PORT   9466
+
+/* Seconds a client has to send or take, not to hold the next scrapes */
+#define CLIENT_TIMEOUT 5
+
+/* CPUs and records read per ioctl */
+#define STATS_BATCH    32
+#define EVENTS_BATCH   256
+
+static const char *opnames[OP_MAX] = {
+	"ignore", "drop", "debug", "panic", "escalate"
+};
+
+/* Same order as NMI_LOCAL .. NMI_IO_CHECK */
+static const char *typenames[NMIMGR_NTYPES] = {
+	"local", "unknown", "serr", "iochk"
+};
+
+/* Counters of struct nmimgr_stats with only a cpu label */
+static const struct {
+	const char *name;
+	size_t off;
+	const char *help;
+} counters[] = {
+#define C(f, h)  { #f, offsetof(struct nmimgr_stats, f), h }
+	C(seen,          "NMIs seen by the handler"),
+	C(unmanaged,     "NMIs with no action, passed to other handlers"),
+	C(test_panic,    "Panics skipped by test_mode"),
+	C(local_skipped, "Watchdog NMIs passed before classification"),
+	C(ack_serr,      "SERR latches cleared by drop_mode=ack"),
+	C(ack_iochk,     "IOCHK latches cleared by drop_mode=ack"),
+	C(refire,        "SERR/IOCHK dropped again within 1ms"),
+	C(overbudget,    "Debug actions longer than budget_us"),
+	C(degraded,      "Debug actions degraded to a cheaper one"),
+	C(claimed_later, "NMIs passed, then claimed by another handler"),
+	C(unclaimed,     "NMIs passed and claimed by nobody"),
+	C(sampled,       "Events not recorded by events_sample"),
+	C(coalesced,     "Events merged in the previous record"),
+	C(depot_full,    "Debug stacks the depot had no room for"),
+#undef C
+};
+
+/* Last record of each CPU ring already counted */
+struct ring_pos {
+	int valid;
+	unsigned long long seq;
+	unsigned int count;
+};
+
+static const char *dev = NMIMGR_DEV;
+static int no_events;
+static int devfd = -1;
+
+static struct nmimgr_cpu_stats batch[STATS_BATCH];
+static struct nmimgr_event events[EVENTS_BATCH];
+static struct nmimgr_stats *cpu_stats;
+static int *cpu_ok;
+static long nr_cpus;
+
+static struct ring_pos *ring_pos;
+static unsigned long long recorded[NMIMGR_NTYPES][NMIMGR_NBMAX][1 << OP_MAX];
+static unsigned long long recorded_unclaimed[NMIMGR_NTYPES][NMIMGR_NBMAX];
+static unsigned long long last_seen;
+
+/* Response being built */
+static char *out;
+static size_t out_len, out_size;
+
+
+static void usage(FILE *out)
+{
+	fprintf(out,
+		"Usage: nmimgr-exporter [-l ADDR:PORT] [-d DEV] [-n]\n"
+		"\n"
+		"  -l ADDR:PORT  Where to serve /metrics (def: %s:%d)\n"
+		"  -d DEV        Control device (def: %s)\n"
+		"  -n            Do not read the events rings, for the per-type\n"
+		"                counters\n",
+		DEFAULT_ADDR, DEFAULT_PORT, NMIMGR_DEV);
+}
+
+static void emit(const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int len;
+
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(out + out_len, out_size - out_len, fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return;
+		if (out_len + len < out_size)
+			break;
+
+		p = realloc(out, out_size * 2 + len);
+		if (!p)
+			return;
+		out = p;
+		out_size = out_size * 2 + len;
+	}
+	out_len += len;
+}
+
+static void emit_ops(unsigned int ops)
+{
+	const char *sep = "";
+	int op;
+
+	if (!ops) {
+		emit("pass");
+		return;
+	}
+	for (op = 0; op < OP_MAX; op++) {
+		if (ops & (1 << op)) {
+			emit("%s%s", sep, opnames[op]);
+			sep = "+";
+		}
+	}
+}
+
+static int read_stats(void)
+{
+	struct nmimgr_cpus_stats req = { 0 };
+	unsigned long long seen = 0;
+	unsigned int i;
+	long cpu;
+
+	memset(cpu_ok, 0, nr_cpus * sizeof(*cpu_ok));
+	while (req.cpu < nr_cpus) {
+		req.nr = STATS_BATCH;
+		req.stats = (unsigned long)batch;
+		if (ioctl(devfd, NMIMGR_IOC_GET_CPUS_STATS, &req)) {
+			fprintf(stderr, "nmimgr-exporter: %s: %s\n", dev,
+				strerror(errno));
+			return -1;
+		}
+		if (!req.nr)
+			break;
+
+		for (i = 0; i < req.nr; i++) {
+			cpu = batch[i].cpu;
+			if (cpu >= nr_cpus)
+				continue;
+			cpu_ok[cpu] = 1;
+			cpu_stats[cpu] = batch[i].stats;
+			seen += batch[i].stats.seen;
+		}
+	}
+
+	/* Module reloaded: the rings start again */
+	if (seen < last_seen)
+		memset(ring_pos, 0, nr_cpus * sizeof(*ring_pos));
+	last_seen = seen;
+	return 0;
+}
+
+/**
+ * Add the records of a CPU written since the last scrape. Its last record
+ * can still grow, so it is read again and only its new count is added
+ */
+static void read_cpu_events(long cpu)
+{
+	struct nmimgr_events_read req;
+	struct ring_pos *pos = &ring_pos[cpu];
+	const struct nmimgr_event *ev;
+	unsigned long long seq;
+	unsigned int i, delta;
+
+	for (;;) {
+		memset(&req, 0, sizeof(req));
+		req.cpu = cpu;
+		req.nr = EVENTS_BATCH;
+		req.seq = pos->valid ? pos->seq : 0;
+		req.events = (unsigned long)events;
+		if (ioctl(devfd, NMIMGR_IOC_GET_EVENTS, &req))
+			return;
+
+		/* Ring allocated again, when the CPU came back online */
+		if (pos->valid && req.head <= pos->seq) {
+			pos->valid = 0;
+			continue;
+		}
+
+		for (i = 0; i < req.nr; i++) {
+			ev = &events[i];
+
+			/* Full sequence number, all records are before req.seq */
+			seq = req.seq - (unsigned int)((unsigned int)req.seq - ev->seq);
+			if (pos->valid && seq < pos->seq)
+				continue;
+			if (pos->valid && seq == pos->seq)
+				delta = ev->count > pos->count ?
+					ev->count - pos->count : 0;
+			else
+				delta = ev->count;
+			pos->valid = 1;
+			pos->seq = seq;
+			pos->count = ev->count;
+
+			if (ev->type >= NMIMGR_NTYPES)
+				continue;
+			if (ev->flags & NMIMGR_EV_UNCLAIMED)
+				recorded_unclaimed[ev->type][ev->reason] += delta;
+			else
+				recorded[ev->type][ev->reason][ev->ops &
+					((1 << OP_MAX) - 1)] += delta;
+		}
+		if (req.nr < EVENTS_BATCH)
+			return;
+	}
+}
+
+static void read_events(void)
+{
+	long cpu;
+
+	if (no_events)
+		return;
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		if (cpu_ok[cpu])
+			read_cpu_events(cpu);
+}
+
+static const __u64 *stat_array(long cpu, size_t off)
+{
+	return (const __u64 *)((const char *)&cpu_stats[cpu] + off);
+}
+
+/**
+ * Family of the per-op array at off in struct nmimgr_stats
+ */
+static void emit_ops_family(const char *name, const char *help, size_t off)
+{
+	unsigned int i;
+	long cpu;
+
+	emit("# TYPE nmimgr_%s counter\n# HELP nmimgr_%s %s\n", name, name,
+		help);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (!cpu_ok[cpu])
+			continue;
+		for (i = 0; i < OP_MAX; i++)
+			emit("nmimgr_%s_total{cpu=\"%ld\",action=\"%s\"} %llu\n",
+				name, cpu, opnames[i], stat_array(cpu, off)[i]);
+	}
+}
+
+/**
+ * Same for a per-reason array, without the zero ones
+ */
+static void emit_reason_family(const char *name, const char *help,
+			size_t off)
+{
+	unsigned int r;
+	long cpu;
+
+	emit("# TYPE nmimgr_%s counter\n# HELP nmimgr_%s %s\n", name, name,
+		help);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (!cpu_ok[cpu])
+			continue;
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			if (stat_array(cpu, off)[r])
+				emit("nmimgr_%s_total{cpu=\"%ld\",reason=\"0x%02x\"} "
+					"%llu\n", name, cpu, r, stat_array(cpu, off)[r]);
+	}
+}
+
+static void build_metrics(void)
+{
+	unsigned int i, r, t, ops;
+	long cpu;
+
+	out_len = 0;
+	if (out)
+		out[0] = '\0';
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		emit("# TYPE nmimgr_%s counter\n", counters[i].name);
+		emit("# HELP nmimgr_%s %s\n", counters[i].name, counters[i].help);
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (!cpu_ok[cpu])
+				continue;
+			emit("nmimgr_%s_total{cpu=\"%ld\"} %llu\n", counters[i].name,
+				cpu, *stat_array(cpu, counters[i].off));
+		}
+	}
+
+	emit("# TYPE nmimgr_handler_seconds counter\n");
+	emit("# HELP nmimgr_handler_seconds Time spent handling NMIs\n");
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		if (cpu_ok[cpu])
+			emit("nmimgr_handler_seconds_total{cpu=\"%ld\"} %.9f\n", cpu,
+				cpu_stats[cpu].handler_ns / 1e9);
+
+	emit_ops_family("actions", "Actions done", offsetof(struct nmimgr_stats,
+		ops));
+	emit_ops_family("shadow_actions", "Actions the shadow policy would do",
+		offsetof(struct nmimgr_stats, shadow_ops));
+
+	/* Only the reasons seen, there are 256 of them per CPU */
+	emit_reason_family("reason", "NMIs seen, per event code",
+		offsetof(struct nmimgr_stats, reason));
+	emit_reason_family("unclaimed_reason", "NMIs claimed by nobody",
+		offsetof(struct nmimgr_stats, unclaimed_reason));
+	emit_reason_family("shadow_diff", "NMIs the shadow policy would do "
+		"otherwise", offsetof(struct nmimgr_stats, shadow_diff));
+
+	emit("# TYPE nmimgr_shadow_reason_actions counter\n");
+	emit("# HELP nmimgr_shadow_reason_actions Actions the shadow policy "
+		"would do, per event code\n");
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (!cpu_ok[cpu])
+			continue;
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			for (i = 0; i < OP_MAX; i++)
+				if (cpu_stats[cpu].shadow_reason[r][i])
+					emit("nmimgr_shadow_reason_actions_total{cpu=\"%ld\","
+						"reason=\"0x%02x\",action=\"%s\"} %llu\n", cpu,
+						r, opnames[i], cpu_stats[cpu].shadow_reason[r][i]);
+	}
+
+	if (no_events)
+		goto end;
+
+	emit("# TYPE nmimgr_recorded counter\n");
+	emit("# HELP nmimgr_recorded Events recorded since the exporter "
+		"started, per type (estimated with events_sample)\n");
+	for (t = 0; t < NMIMGR_NTYPES; t++) {
+		for (r = 0; r < NMIMGR_NBMAX; r++) {
+			for (ops = 0; ops < 1 << OP_MAX; ops++) {
+				if (!recorded[t][r][ops])
+					continue;
+				emit("nmimgr_recorded_total{type=\"%s\",reason=\"0x%02x\","
+					"ops=\"", typenames[t], r);
+				emit_ops(ops);
+				emit("\"} %llu\n", recorded[t][r][ops]);
+			}
+			if (recorded_unclaimed[t][r])
+				emit("nmimgr_recorded_total{type=\"%s\",reason=\"0x%02x\","
+					"ops=\"unclaimed\"} %llu\n", typenames[t], r,
+					recorded_unclaimed[t][r]);
+		}
+	}
+
+end:
+	emit("# EOF\n");
+}
+
+static void reply(int fd, const char *status, const char *type,
+			const char *body, size_t len)
+{
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+		"Content-Type: %s\r\nContent-Length: %zu\r\n"
+		"Connection: close\r\n\r\n", status, type, len);
+	if (write(fd, hdr, n) != n)
+		return;
+	while (len) {
+		ssize_t w = write(fd, body, len);
+
+		if (w <= 0)
+			return;
+		body += w;
+		len -= w;
+	}
+}
+
+static void serve(int fd)
+{
+	char req[1024];
+	struct timeval tv = { .tv_sec = CLIENT_TIMEOUT };
+	ssize_t len;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	len = read(fd, req, sizeof(req) - 1);
+	if (len <= 0)
+		return;
+	req[len] = '\0';
+
+	if (strncmp(req, "GET /metrics ", 13)) {
+		reply(fd, "404 Not Found", "text/plain", "Not found\n", 10);
+		return;
+	}
+
+	if (read_stats()) {
+		reply(fd, "503 Service Unavailable", "text/plain",
+			"nmimgr unavailable\n", 19);
+		return;
+	}
+	read_events();
+	build_metrics();
+	reply(fd, "200 OK", "application/openmetrics-text; version=1.0.0; "
+		"charset=utf-8", out, out_len);
+}
+
+static int listen_on(const char *spec)
+{
+	struct sockaddr_in sa;
+	char addr[64] = DEFAULT_ADDR;
+	const char *colon = strrchr(spec, ':');
+	int fd, one = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(DEFAULT_PORT);
+
+	if (colon) {
+		if ((size_t)(colon - spec) >= sizeof(addr))
+			return -1;
+		if (colon > spec) {
+			memcpy(addr, spec, colon - spec);
+			addr[colon - spec] = '\0';
+		}
+		sa.sin_port = htons(atoi(colon + 1));
+	}
+	if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+		fprintf(stderr, "nmimgr-exporter: '%s': bad address\n", spec);
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 8)) {
+		fprintf(stderr, "nmimgr-exporter: %s: %s\n", spec, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	const char *spec = DEFAULT_ADDR;
+	int opt, sock, fd;
+
+	while ((opt = getopt(argc, argv, "l:d:nh")) != -1) {
+		switch (opt) {
+		case 'l':
+			spec = optarg;
+			break;
+		case 'd':
+			dev = optarg;
+			break;
+		case 'n':
+			no_events = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 2;
+		}
+	}
+
+	devfd = open(dev, O_RDONLY);
+	if (devfd < 0) {
+		fprintf(stderr, "nmimgr-exporter: %s: %s\n", dev, strerror(errno));
+		return 1;
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (nr_cpus < 1)
+		nr_cpus = 1;
+	cpu_stats = calloc(nr_cpus, sizeof(*cpu_stats));
+	cpu_ok = calloc(nr_cpus, sizeof(*cpu_ok));
+	ring_pos = calloc(nr_cpus, sizeof(*ring_pos));
+	out_size = 65536;
+	out = malloc(out_size);
+	if (!cpu_stats || !cpu_ok || !ring_pos || !out) {
+		fprintf(stderr, "nmimgr-exporter: out of memory\n");
+		return 1;
+	}
+
+	sock = listen_on(spec);
+	if (sock < 0)
+		return 1;
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Count the records already there, not as new ones at the first scrape */
+	if (!read_stats())
+		read_events();
+	memset(recorded, 0, sizeof(recorded));
+	memset(recorded_unclaimed, 0, sizeof(recorded_unclaimed));
+
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "nmimgr-exporter: accept: %s\n",
+				strerror(errno));
+			return 1;
+		}
+		serve(fd);
+		close(fd);
+	}
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * libFuzzer target for the policy compiler of nmimgr_policy.h, the one of
+ * the module parameters and of nmimgrctl. Each input goes through the list
+ * and the sampling parsers, which must:
+ *   - stay within the input and the tables (run it with ASan)
+ *   - give the same result twice
+ *   - only set the op bit, on the types asked for
+ *   - on error, have applied exactly the rules before the bad one
+ * and return fast enough for -timeout.
+ *
+ * Built without libFuzzer (-DNMIMGR_FUZZ_MAIN), it runs the files given as
+ * arguments once, eg the seeds, to reproduce a crash.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nmimgr.h"
+#include "nmimgr_policy.h"
+
+/* Longer than what the kernel command line or modprobe would give */
+#define FUZZ_MAXLEN  4096
+
+static struct nmimgr_policy pol, again, prefix;
+static __u16 rate[NMIMGR_NBMAX], rate_again[NMIMGR_NBMAX];
+static char str[FUZZ_MAXLEN + 1];
+
+#define CHECK(cond)  do {                                               \
+	if (!(cond)) {                                                  \
+		fprintf(stderr, "nmimgr-fuzz: '%s' fails on \"%s\"\n",  \
+			#cond, str);                                    \
+		abort();                                                \
+	}                                                               \
+} while (0)
+
+/**
+ * Returns -1 on error, with *err as an offset in str
+ */
+static int parse(struct nmimgr_policy *p, unsigned int types, int op,
+			const char *s, long *err)
+{
+	const char *e = NULL;
+	int ret;
+
+	nmimgr_policy_init(p);
+	ret = nmimgr_policy_parse_types(p, types, op, s, &e);
+	if (ret)
+		*err = e - s;
+	return ret;
+}
+
+static void fuzz_list(size_t len)
+{
+	/* Cover the per-type path too, with a type taken from the input */
+	unsigned int type = len % NMIMGR_NTYPES;
+	unsigned int all = (1 << NMIMGR_NTYPES) - 1;
+	int op = len % OP_MAX;
+	long err = 0, err2 = 0;
+	unsigned int t, r;
+	int ret;
+
+	ret = parse(&pol, all, op, str, &err);
+	CHECK(ret == parse(&again, all, op, str, &err2));
+	CHECK(!memcmp(&pol, &again, sizeof(pol)));
+	if (ret) {
+		CHECK(err == err2);
+		CHECK(err >= 0 && (size_t)err < len);
+	}
+
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			CHECK(!(pol.act[t][r] & ~(1 << op)));
+	CHECK(!nmimgr_policy_check(&pol));
+
+	/* Only one type, same codes */
+	CHECK(ret == parse(&again, 1 << type, op, str, &err2));
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			CHECK(again.act[t][r] == (t == type ? pol.act[0][r] : 0));
+
+	/* The rules before the bad one were applied, and are valid alone */
+	if (ret) {
+		str[err] = '\0';
+		CHECK(!parse(&prefix, all, op, str, &err2));
+		CHECK(!memcmp(&pol, &prefix, sizeof(pol)));
+	}
+}
+
+static void fuzz_sample(size_t len)
+{
+	const char *e = NULL, *e2 = NULL;
+	int ret;
+
+	memset(rate, 0, sizeof(rate));
+	memset(rate_again, 0, sizeof(rate_again));
+
+	ret = nmimgr_sample_parse(rate, str, &e);
+	CHECK(ret == nmimgr_sample_parse(rate_again, str, &e2));
+	CHECK(!memcmp(rate, rate_again, sizeof(rate)));
+	if (ret)
+		CHECK(e == e2 && e >= str && e < str + len);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	size_t len;
+
+	if (size > FUZZ_MAXLEN)
+		return 0;
+
+	/* The parsers take C strings: stop at the first NUL */
+	memcpy(str, data, size);
+	str[size] = '\0';
+	len = strlen(str);
+
+	fuzz_sample(len);
+	/* Last, as it cuts str on errors */
+	fuzz_list(len);
+	return 0;
+}
+
+#ifdef NMIMGR_FUZZ_MAIN
+int main(int argc, char **argv)
+{
+	static uint8_t buf[FUZZ_MAXLEN];
+	size_t len;
+	FILE *f;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+		len = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,245 @@
+#!/bin/bash
+#
+# Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License version 2 as published
+# by the Free Software Foundation.
+#
+# Time from an NMI to the crash kernel, per kernel and per nmimgr panic
+# strategy. Each run boots a QEMU guest, sends an NMI from the monitor and
+# timestamps the serial console lines on the host:
+#   nmimgr   the "nmimgr: Panic on ..." line
+#   panic    the "Kernel panic - not syncing" line
+#   crash    the first line of the crash kernel ("Linux version")
+# all in ms after the NMI was sent.
+#
+# The disk image must have kdump set up for each kernel (crashkernel= is
+# added here, the crash kernel must print on ttyS0) and load nmimgr at boot.
+# The policy is given on the kernel cmdline, which modprobe also reads.
+#
+
+set -u
+export LC_ALL=C
+
+typeset MYSELF="$(readlink -f $0)"
+typeset MYNAME="${MYSELF##*/}"
+
+# Overridable values from environment
+typeset QEMU="${QEMU:-qemu-system-x86_64}"
+typeset BENCH_DISK="${BENCH_DISK:-}"
+typeset BENCH_ROOT="${BENCH_ROOT:-/dev/vda1}"
+typeset BENCH_MEM="${BENCH_MEM:-2048}"
+typeset BENCH_CPUS="${BENCH_CPUS:-2}"
+typeset BENCH_CRASHMEM="${BENCH_CRASHMEM:-256M}"
+typeset BENCH_APPEND="${BENCH_APPEND:-}"
+typeset BENCH_RUNS="${BENCH_RUNS:-5}"
+typeset BENCH_STRATEGIES="${BENCH_STRATEGIES:-panic escalate unclaimed}"
+typeset BENCH_READY="${BENCH_READY:-login:}"
+typeset BENCH_SETTLE="${BENCH_SETTLE:-5}"
+typeset BENCH_TIMEOUT="${BENCH_TIMEOUT:-300}"
+typeset BENCH_OUT="${BENCH_OUT:-nmimgr-kdumpbench.$(date +%Y%m%d-%H%M%S)}"
+
+# A NMI from the QEMU monitor reads port 0x61 with SERR and IOCHK clear,
+# and the PIT bits 4 and 5 changing: match all of them
+typeset NMI_REASON="0xc0:0"
+
+# Escalation: NMIs within this delay of the capture are the same burst and
+# do not panic (NMIMGR_ESCALATE_HOLDOFF_MS), so wait a bit more
+typeset HOLDOFF="1.5"
+
+typeset TMPDIR="$(mktemp -d)"
+typeset QEMU_PID=""
+
+trap 'cleanup' EXIT
+
+function cleanup {
+	[[ -n "$QEMU_PID" ]] && kill $QEMU_PID 2>/dev/null
+	rm -rf "$TMPDIR"
+}
+
+function usage {
+	echo "Usage: $MYNAME [-d DISK] [-r RUNS] [-s STRATEGIES] KERNEL[:INITRD]..."
+	echo
+	echo "  -d DISK        Guest disk image (BENCH_DISK)"
+	echo "  -r RUNS        Runs per kernel and strategy (BENCH_RUNS, def: 5)"
+	echo "  -s STRATEGIES  Among panic, escalate, unclaimed (BENCH_STRATEGIES)"
+	echo "  -o DIR         Where to keep the consoles and results (BENCH_OUT)"
+	echo
+	echo "  panic      events_panic: the first NMI panics"
+	echo "  escalate   events_escalate: the first NMI captures all CPUs, the"
+	echo "             second one (timed) panics"
+	echo "  unclaimed  unclaimed_panic: panic in the last NMI handler"
+	echo
+	echo "Other settings from environment: QEMU, BENCH_ROOT, BENCH_MEM,"
+	echo "BENCH_CPUS, BENCH_CRASHMEM, BENCH_APPEND, BENCH_READY (regex of the"
+	echo "console line when the guest is up), BENCH_SETTLE, BENCH_TIMEOUT"
+}
+
+# Module parameters of a strategy, for the kernel cmdline
+function strategyArgs {
+	case "$1" in
+		panic)      echo "nmimgr.events_panic=$NMI_REASON" ;;
+		escalate)   echo "nmimgr.events_escalate=$NMI_REASON" ;;
+		unclaimed)  echo "nmimgr.unclaimed_panic=$NMI_REASON" ;;
+		*)          return 1 ;;
+	esac
+}
+
+# Prefix each console line with the host time, without forking
+function stamp {
+	typeset line
+	while IFS= read -r line; do
+		printf '%s %s\n' "$EPOCHREALTIME" "${line%$'\r'}"
+	done
+}
+
+# Wait for a console line matching $2 in file $1, after line $3
+function waitFor {
+	typeset file="$1" regex="$2" after="${3:-0}"
+	typeset -i end=$(( SECONDS + BENCH_TIMEOUT ))
+
+	while (( SECONDS < end )); do
+		tail -n +$(( after + 1 )) "$file" | grep -qE -- "$regex" && return 0
+		kill -0 $QEMU_PID 2>/dev/null || return 1
+		sleep 0.2
+	done
+	return 1
+}
+
+function sendNmi {
+	printf 'nmi\n' | socat - "UNIX-CONNECT:$TMPDIR/monitor" >/dev/null
+}
+
+# Host time of the first line matching $2 in file $1, after line $3
+function lineTime {
+	awk -v re="$2" -v after="$3" 'NR > after && substr($0, index($0, " ") + 1) ~ re { print $1; exit }' "$1"
+}
+
+function msSince {
+	[[ -z "$2" ]] && { echo "-"; return; }
+	awk -v t0="$1" -v t="$2" 'BEGIN { printf "%.1f", (t - t0) * 1000 }'
+}
+
+# One boot and NMI. Prints "nmimgr panic crash" in ms, "-" when not seen
+function runOnce {
+	typeset kernel="$1" initrd="$2" strategy="$3" console="$4"
+	typeset -a initrdArgs=()
+	typeset -i booted
+	typeset t0 append
+
+	[[ -n "$initrd" ]] && initrdArgs=(-initrd "$initrd")
+	append="root=$BENCH_ROOT console=ttyS0 crashkernel=$BENCH_CRASHMEM"
+	append="$append $(strategyArgs $strategy) $BENCH_APPEND"
+
+	rm -f "$TMPDIR/monitor" "$TMPDIR/qemu.pid"
+	"$QEMU" -enable-kvm -m "$BENCH_MEM" -smp "$BENCH_CPUS" \
+		-display none -serial stdio \
+		-monitor "unix:$TMPDIR/monitor,server,nowait" \
+		-pidfile "$TMPDIR/qemu.pid" \
+		-drive "file=$BENCH_DISK,if=virtio,snapshot=on" \
+		-kernel "$kernel" "${initrdArgs[@]}" -append "$append" \
+		</dev/null 2>"$console.qemu" | stamp > "$console" &
+
+	# QEMU writes its pidfile once started, or exits on a bad setup
+	typeset -i tries
+	for (( tries = 0; tries < 100; tries++ )); do
+		[[ -s "$TMPDIR/qemu.pid" ]] && QEMU_PID="$(< "$TMPDIR/qemu.pid")"
+		[[ -n "$QEMU_PID" ]] && break
+		jobs -r %% >/dev/null 2>&1 || break
+		sleep 0.1
+	done
+	if [[ -z "$QEMU_PID" ]]; then
+		echo "[E] $kernel/$strategy: QEMU did not start, see $console.qemu" >&2
+		wait
+		echo "- - -"
+		return 1
+	fi
+
+	if ! waitFor "$console" "$BENCH_READY"; then
+		echo "[E] $kernel/$strategy: guest not ready, see $console" >&2
+		kill $QEMU_PID 2>/dev/null; wait; QEMU_PID=""
+		echo "- - -"
+		return 1
+	fi
+	sleep "$BENCH_SETTLE"
+	booted=$(wc -l < "$console")
+
+	# Escalation: the first NMI is the capture, the measure is the panic,
+	# sent once past the holdoff (not counted in the times)
+	if [[ "$strategy" == "escalate" ]]; then
+		sendNmi
+		waitFor "$console" "nmimgr: Captured all CPUs" $booted
+		booted=$(wc -l < "$console")
+		sleep "$HOLDOFF"
+	fi
+
+	t0="$EPOCHREALTIME"
+	sendNmi
+	waitFor "$console" "Linux version" $booted
+
+	kill $QEMU_PID 2>/dev/null; wait; QEMU_PID=""
+
+	echo "$(msSince $t0 "$(lineTime "$console" "nmimgr: Panic on" $booted)")" \
+		"$(msSince $t0 "$(lineTime "$console" "Kernel panic - not syncing" $booted)")" \
+		"$(msSince $t0 "$(lineTime "$console" "Linux version" $booted)")"
+}
+
+# Median of each column of the runs, ignoring the ones not seen
+function median {
+	typeset -i col
+	for col in 1 2 3; do
+		awk -v c=$col '$c != "-" { print $c }' "$1" | sort -n | \
+			awk '{ v[NR] = $1 } END { if (!NR) print "-"; else if (NR % 2) print v[(NR + 1) / 2]; else printf "%.1f\n", (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+	done | paste -sd ' '
+}
+
+
+while getopts ":d:r:s:o:h" opt; do
+	case "$opt" in
+		d)  BENCH_DISK="$OPTARG" ;;
+		r)  BENCH_RUNS="$OPTARG" ;;
+		s)  BENCH_STRATEGIES="$OPTARG" ;;
+		o)  BENCH_OUT="$OPTARG" ;;
+		h)  usage; exit 0 ;;
+		*)  usage >&2; exit 2 ;;
+	esac
+done
+shift $(( OPTIND - 1 ))
+
+[[ $# -eq 0 ]] || [[ -z "$BENCH_DISK" ]] && { usage >&2; exit 2; }
+[[ -z "${EPOCHREALTIME:-}" ]] && { echo "[E] bash 5 or newer is needed"; exit 1; }
+for bin in "$QEMU" socat; do
+	type -p "$bin" >/dev/null || { echo "[E] Missing '$bin'"; exit 1; }
+done
+for strategy in $BENCH_STRATEGIES; do
+	strategyArgs $strategy >/dev/null || { echo "[E] Unknown strategy '$strategy'"; exit 2; }
+done
+
+mkdir -p "$BENCH_OUT"
+echo "[I] Consoles and results in '$BENCH_OUT'"
+
+for spec in "$@"; do
+	typeset kernel="${spec%%:*}" initrd=""
+	[[ "$spec" == *:* ]] && initrd="${spec#*:}"
+	typeset kname="$(basename "$kernel")"
+
+	for strategy in $BENCH_STRATEGIES; do
+		typeset runs="$BENCH_OUT/$kname.$strategy.runs"
+		: > "$runs"
+		for (( i = 1; i <= BENCH_RUNS; i++ )); do
+			echo "[I] $kname / $strategy: run $i/$BENCH_RUNS"
+			runOnce "$kernel" "$initrd" "$strategy" \
+				"$BENCH_OUT/$kname.$strategy.$i.console" >> "$runs"
+		done
+		echo "$kname $strategy $(awk '$3 != "-"' "$runs" | wc -l)/$BENCH_RUNS $(median "$runs")" \
+			>> "$BENCH_OUT/results"
+	done
+done
+
+echo
+echo "Median time after the NMI, in ms"
+{
+	echo "KERNEL STRATEGY DUMPED NMIMGR PANIC CRASHKERNEL"
+	cat "$BENCH_OUT/results"
+} | column -t
@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * nmimgr-replay: run recorded NMI events through candidate policies, with
+ * the module's own decisions, to see what they would have done.
+ *
+ * Events are read from the debugfs "events" file, the nmimgr-drgn.py
+ * output of a vmcore, or the kernel logs (dmesg, pstore) "Handling new NMI"
+ * lines. The logs have neither the CPU nor the ignored events.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nmimgr.h"
+#include "nmimgr_policy.h"
+
+/* As in nmimgr.c */
+#define REFIRE_NS   1000000ULL
+#define HOLDOFF_NS  1000000000ULL
+
+/* Latch bits of the NMI reason port, from asm/mach_traps.h */
+#define NMI_REASON_SERR   0x80
+#define NMI_REASON_IOCHK  0x40
+
+/* Final action of a decision, debug aside */
+enum {
+	FIN_PASS=0,
+	FIN_IGNORE,
+	FIN_DROP,
+	FIN_ESCALATE,
+	FIN_PANIC,
+	FIN_MAX
+};
+
+static const char *opnames[OP_MAX] = {
+	"ignore", "drop", "debug", "panic", "escalate"
+};
+
+static const char *finnames[FIN_MAX] = {
+	"pass", "ignore", "drop", "escalate", "panic"
+};
+
+struct event {
+	unsigned long long ts;
+	unsigned long long last;
+	unsigned int count;
+	unsigned int cpu;
+	unsigned int type;
+	unsigned int reason;
+	int ops;                /* Recorded, -1 if not known */
+};
+
+struct candidate {
+	const char *path;
+	struct nmimgr_policy pol;
+	unsigned long long fin[FIN_MAX];
+	unsigned long long diff[NMIMGR_NBMAX][FIN_MAX][FIN_MAX];
+	unsigned long long debug_diff;
+	unsigned long long escalations;
+	unsigned long long panics;
+	unsigned long long refire[NMIMGR_NBMAX];
+	unsigned long long refire_ts[NMIMGR_NBMAX];
+	unsigned long long armed[NMIMGR_NBMAX];
+	unsigned long long *last_ts;    /* Per CPU and reason */
+};
+
+static struct event *events;
+static size_t nr_events, max_events;
+static unsigned int nr_cpus = 1;
+
+static struct nmimgr_policy baseline;
+static int has_baseline;
+static unsigned long long window = 60000;     /* escalate_window, in ms */
+static unsigned int max_panics = 20;
+
+
+static void usage(FILE *out)
+{
+	fprintf(out,
+		"Usage: nmimgr-replay [-b POLICY] [-w MS] [-n N] -p POLICY... "
+		"[LOG...]\n"
+		"\n"
+		"  -p POLICY  Candidate policy, compiled by 'nmimgrctl compile'\n"
+		"  -b POLICY  Compare with this policy instead of the recorded "
+		"actions\n"
+		"  -w MS      escalate_window of the candidates (def: 60000)\n"
+		"  -n N       Would-be panics listed per candidate (def: 20, "
+		"0: all)\n"
+		"\n"
+		"LOG is a debugfs events file, a nmimgr-drgn.py output or kernel\n"
+		"logs, stdin if none. Events are replayed in time order.\n");
+}
+
+static int load_policy(const char *path, struct nmimgr_policy *pol)
+{
+	FILE *f = fopen(path, "rb");
+	size_t len;
+
+	if (!f) {
+		fprintf(stderr, "nmimgr-replay: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	len = fread(pol, 1, sizeof(*pol), f);
+	if (len == sizeof(*pol) && fgetc(f) != EOF)
+		len = 0;
+	fclose(f);
+
+	if (len != sizeof(*pol) || nmimgr_policy_check(pol)) {
+		fprintf(stderr, "nmimgr-replay: %s: not a policy\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int fin(unsigned char dec)
+{
+	if (dec & (1 << OP_IGNORE))
+		return FIN_IGNORE;
+	if (dec & (1 << OP_DROP))
+		return FIN_DROP;
+	if (dec & (1 << OP_ESCALATE))
+		return FIN_ESCALATE;
+	if (dec & (1 << OP_PANIC))
+		return FIN_PANIC;
+	return FIN_PASS;
+}
+
+/**
+ * "pass" or op names joined by '+', as nmimgr_print_ops()
+ */
+static int parse_ops(const char *s)
+{
+	int ops = 0, op;
+	size_t len;
+
+	if (!strncmp(s, "pass", 4))
+		return 0;
+
+	while (*s && *s != ' ' && *s != '\n') {
+		len = strcspn(s, "+ \n");
+		for (op = 0; op < OP_MAX; op++)
+			if (strlen(opnames[op]) == len && !strncmp(s, opnames[op], len))
+				break;
+		if (op == OP_MAX)
+			return -1;
+		ops |= 1 << op;
+		s += len;
+		if (*s == '+')
+			s++;
+	}
+	return ops;
+}
+
+static const char *field(const char *line, const char *name)
+{
+	const char *s = strstr(line, name);
+
+	return s ? s + strlen(name) : NULL;
+}
+
+/**
+ * "[  sec.usec]" at the start of the line, as printk and nmimgr-drgn.py
+ */
+static int parse_stamp(const char *line, unsigned long long *ts)
+{
+	unsigned long long sec, usec;
+	const char *s = strchr(line, '[');
+
+	if (!s || sscanf(s, "[ %llu.%llu]", &sec, &usec) != 2)
+		return -1;
+	*ts = sec * 1000000000ULL + usec * 1000ULL;
+	return 0;
+}
+
+/**
+ * One line of any of the formats. Returns 0 for an event, -1 otherwise
+ */
+static int parse_line(const char *line, struct event *ev)
+{
+	const char *s;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->count = 1;
+	ev->ops = -1;
+
+	/* Kernel logs */
+	s = field(line, NMIMGR_NAME": Handling new NMI type:");
+	if (s) {
+		if (sscanf(s, "%u event:0x%x", &ev->type, &ev->reason) != 2)
+			return -1;
+		parse_stamp(line, &ev->ts);
+		ev->last = ev->ts;
+		return ev->type < NMIMGR_NTYPES && ev->reason < NMIMGR_NBMAX ?
+			0 : -1;
+	}
+
+	/* Ring records. The unclaimed ones are already in the first stage */
+	if (!field(line, " type=") || !field(line, " reason=0x") ||
+	    strstr(line, " unclaimed"))
+		return -1;
+
+	s = field(line, "ts=");
+	if (s)
+		ev->ts = strtoull(s, NULL, 10);
+	else if (parse_stamp(line, &ev->ts))
+		return -1;
+
+	ev->type = strtoul(field(line, " type="), NULL, 10);
+	ev->reason = strtoul(field(line, " reason=0x"), NULL, 16);
+	if (ev->type >= NMIMGR_NTYPES || ev->reason >= NMIMGR_NBMAX)
+		return -1;
+
+	if ((s = field(line, " cpu=")))
+		ev->cpu = strtoul(s, NULL, 10);
+	if ((s = field(line, " ops=")))
+		ev->ops = parse_ops(s);
+	if ((s = field(line, " count=")))
+		ev->count = strtoul(s, NULL, 10);
+	ev->last = ev->ts;
+	if ((s = field(line, " last=")))
+		ev->last = strtoull(s, NULL, 10);
+	/* nmimgr-drgn.py prints ts in us, but last in ns */
+	if (ev->last < ev->ts)
+		ev->last = ev->ts;
+
+	if (!ev->count)
+		ev->count = 1;
+	return 0;
+}
+
+static int load_events(FILE *f)
+{
+	char line[512];
+	struct event ev, *p;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (parse_line(line, &ev))
+			continue;
+
+		if (nr_events == max_events) {
+			max_events = max_events ? max_events * 2 : 4096;
+			p = realloc(events, max_events * sizeof(*events));
+			if (!p) {
+				fprintf(stderr, "nmimgr-replay: out of memory\n");
+				return -1;
+			}
+			events = p;
+		}
+		events[nr_events++] = ev;
+		if (ev.cpu >= nr_cpus)
+			nr_cpus = ev.cpu + 1;
+	}
+	return 0;
+}
+
+static int cmp_events(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	return (int)x->cpu - (int)y->cpu;
+}
+
+static void print_ts(unsigned long long ts)
+{
+	printf("[%5llu.%06llu]", ts / 1000000000ULL, ts % 1000000000ULL / 1000);
+}
+
+/**
+ * One NMI through the candidate. Only the NMIs with a known time (timed)
+ * go through the escalation and refire detection of the module
+ */
+static void replay_one(struct candidate *c, const struct event *ev,
+			unsigned long long ts, int timed, int base)
+{
+	unsigned char dec = nmimgr_policy_decide(c->pol.act[ev->type][ev->reason]);
+	unsigned long long armed = c->armed[ev->reason];
+	unsigned long long *last_ts = &c->last_ts[ev->cpu * NMIMGR_NBMAX +
+		ev->reason];
+	unsigned long long gap = *last_ts ? ts - *last_ts : ~0ULL;
+	int f = fin(dec), panic = 0;
+
+	c->fin[f]++;
+	if (base >= 0) {
+		c->diff[ev->reason][fin(base)][f]++;
+		if ((dec ^ base) & (1 << OP_DEBUG) && f != FIN_IGNORE)
+			c->debug_diff++;
+	}
+
+	if (!timed)
+		goto out;
+	*last_ts = ts;
+
+	if (f == FIN_DROP &&
+	    (ev->reason & (NMI_REASON_SERR | NMI_REASON_IOCHK))) {
+		if (gap < REFIRE_NS && !c->refire[ev->reason]++)
+			c->refire_ts[ev->reason] = ts;
+	}
+
+	if (f == FIN_ESCALATE) {
+		if (armed && ts - armed < window * 1000000ULL) {
+			if (ts - armed >= HOLDOFF_NS)
+				panic = 1;
+		} else {
+			c->armed[ev->reason] = ts;
+			c->escalations++;
+		}
+	}
+
+out:
+	if (f == FIN_PANIC || panic) {
+		if (!max_panics || c->panics < max_panics) {
+			printf("  would panic ");
+			print_ts(ts);
+			printf(" cpu=%u type=%u reason=0x%02x%s\n", ev->cpu,
+				ev->type, ev->reason, panic ? " (escalated)" : "");
+		}
+		c->panics++;
+	}
+}
+
+/**
+ * Decision of the reference, from the recorded ops or the -b policy
+ */
+static int base_decision(const struct event *ev)
+{
+	if (has_baseline)
+		return nmimgr_policy_decide(baseline.act[ev->type][ev->reason]);
+	if (ev->ops < 0)
+		return -1;
+	/* Second stage of an escalation, recorded as escalate+panic */
+	if (ev->ops & (1 << OP_ESCALATE))
+		return ev->ops & ~(1 << OP_PANIC);
+	return ev->ops;
+}
+
+static void replay(struct candidate *c)
+{
+	const struct event *ev;
+	unsigned long long ts;
+	unsigned int i;
+	size_t n;
+	int r, from, to, last;
+
+	printf("%s:\n", c->path);
+	for (n = 0; n < nr_events; n++) {
+		ev = &events[n];
+		/*
+		 * Only the first and last NMIs of a record have a time: the
+		 * coalesced and sampled ones between are decided, but do not
+		 * make up refires or escalations out of guessed gaps
+		 */
+		for (i = 0; i < ev->count; i++) {
+			last = i == ev->count - 1 && ev->last != ev->ts;
+			ts = last ? ev->last : ev->ts;
+			replay_one(c, ev, ts, !i || last, base_decision(ev));
+		}
+	}
+	if (max_panics && c->panics > max_panics)
+		printf("  ... %llu more would-be panics\n", c->panics - max_panics);
+
+	printf("  actions:");
+	for (i = 0; i < FIN_MAX; i++)
+		printf(" %s=%llu", finnames[i], c->fin[i]);
+	printf("\n  escalations armed: %llu, panics: %llu\n", c->escalations,
+		c->panics);
+
+	for (r = 0; r < NMIMGR_NBMAX; r++) {
+		for (from = 0; from < FIN_MAX; from++) {
+			for (to = 0; to < FIN_MAX; to++) {
+				if (from == to || !c->diff[r][from][to])
+					continue;
+				printf("  reason 0x%02x: %s -> %s: %llu\n", r,
+					finnames[from], finnames[to],
+					c->diff[r][from][to]);
+			}
+		}
+	}
+	if (c->debug_diff)
+		printf("  debug changed: %llu\n", c->debug_diff);
+
+	for (r = 0; r < NMIMGR_NBMAX; r++) {
+		if (!c->refire[r])
+			continue;
+		printf("  reason 0x%02x: refire %llu, first ", r, c->refire[r]);
+		print_ts(c->refire_ts[r]);
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct candidate *cands;
+	unsigned int nr_cands = 0;
+	FILE *f;
+	int opt, i;
+
+	cands = calloc(argc, sizeof(*cands));
+	if (!cands) {
+		fprintf(stderr, "nmimgr-replay: out of memory\n");
+		return 1;
+	}
+
+	while ((opt = getopt(argc, argv, "b:p:w:n:h")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (load_policy(optarg, &baseline))
+				return 1;
+			has_baseline = 1;
+			break;
+		case 'p':
+			cands[nr_cands].path = optarg;
+			if (load_policy(optarg, &cands[nr_cands].pol))
+				return 1;
+			nr_cands++;
+			break;
+		case 'w':
+			window = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			max_panics = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 2;
+		}
+	}
+
+	if (!nr_cands) {
+		usage(stderr);
+		return 2;
+	}
+
+	if (optind == argc && load_events(stdin))
+		return 1;
+	for (i = optind; i < argc; i++) {
+		f = fopen(argv[i], "r");
+		if (!f) {
+			fprintf(stderr, "nmimgr-replay: %s: %s\n", argv[i],
+				strerror(errno));
+			return 1;
+		}
+		if (load_events(f))
+			return 1;
+		fclose(f);
+	}
+
+	qsort(events, nr_events, sizeof(*events), cmp_events);
+	printf("%zu records, compared with %s\n", nr_events,
+		has_baseline ? "the -b policy" : "the recorded actions");
+
+	for (i = 0; i < (int)nr_cands; i++) {
+		cands[i].last_ts = calloc(nr_cpus * NMIMGR_NBMAX,
+			sizeof(*cands[i].last_ts));
+		if (!cands[i].last_ts) {
+			fprintf(stderr, "nmimgr-replay: out of memory\n");
+			return 1;
+		}
+		replay(&cands[i]);
+		free(cands[i].last_ts);
+	}
+
+	free(events);
+	free(cands);
+	return 0;
+}
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2017 Adrien Mahieux <adrien.mahieux@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * nmimgrctl: compile, upload and inspect nmimgr policies through
+ * /dev/nmimgr, without reloading the module.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "nmimgr.h"
+#include "nmimgr_policy.h"
+
+#define NMIMGR_DEV     "/dev/" NMIMGR_NAME
+#define NMIMGR_EVENTS  "/sys/kernel/debug/" NMIMGR_NAME "/events"
+
+static const char *opnames[OP_MAX] = {
+	"ignore", "drop", "debug", "panic", "escalate"
+};
+
+/* Same order as NMI_LOCAL .. NMI_IO_CHECK */
+static const char *typenames[NMIMGR_NTYPES] = {
+	"local", "unknown", "serr", "iochk"
+};
+
+static const char *dev = NMIMGR_DEV;
+
+/* -s: load, set and show work on the shadow policy */
+static int shadow;
+
+
+static void usage(FILE *out)
+{
+	fprintf(out,
+		"Usage: nmimgrctl [-d DEV] [-s] COMMAND [ARGS]\n"
+		"\n"
+		"Commands:\n"
+		"  compile RULE...  Write the binary policy of RULEs to stdout\n"
+		"  bake RULE...     Write RULEs as a C header, to build them in\n"
+		"                   the module (make POLICY=...)\n"
+		"  load FILE        Upload a compiled policy (- for stdin)\n"
+		"  set RULE...      Compile and upload RULEs\n"
+		"  show [FILE]      Print the live policy, or a compiled one\n"
+		"  stats            Print the counters\n"
+		"  events           Print the last events (needs debugfs)\n"
+		"  unshadow         Stop evaluating the shadow policy\n"
+		"  promote          Make the shadow policy the live one\n"
+		"\n"
+		"With -s, load, set and show work on the shadow policy: it is\n"
+		"evaluated with the live one, but its actions are only counted.\n"
+		"\n"
+		"A RULE is OP[/TYPE]=LIST, eg panic=0x3c or drop/serr=0x80:0x80\n"
+		"  OP    ignore, drop, debug, panic, escalate\n"
+		"  TYPE  local, unknown, serr, iochk (default: all of them)\n"
+		"  LIST  as the events_* module parameters\n"
+		"@FILE reads RULEs from FILE, separated by spaces or lines, with\n"
+		"# comments.\n"
+		"A new policy replaces the live one, it is not merged.\n");
+}
+
+static int lookup(const char *name, size_t len, const char **names, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (strlen(names[i]) == len && !strncmp(name, names[i], len))
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Add one OP[/TYPE]=LIST rule to the policy
+ */
+static int compile_rule(struct nmimgr_policy *pol, const char *rule)
+{
+	const char *eq = strchr(rule, '=');
+	const char *slash = strchr(rule, '/');
+	const char *err = NULL;
+	unsigned int types = (1 << NMIMGR_NTYPES) - 1;
+	int op, type;
+
+	if (!eq || (slash && slash > eq))
+		slash = NULL;
+	if (!eq) {
+		fprintf(stderr, "nmimgrctl: '%s': expected OP[/TYPE]=LIST\n", rule);
+		return -1;
+	}
+
+	op = lookup(rule, (slash ? slash : eq) - rule, opnames, OP_MAX);
+	if (op < 0) {
+		fprintf(stderr, "nmimgrctl: '%s': unknown action\n", rule);
+		return -1;
+	}
+
+	if (slash) {
+		type = lookup(slash + 1, eq - slash - 1, typenames, NMIMGR_NTYPES);
+		if (type < 0) {
+			fprintf(stderr, "nmimgrctl: '%s': unknown NMI type\n", rule);
+			return -1;
+		}
+		types = 1 << type;
+	}
+
+	if (nmimgr_policy_parse_types(pol, types, op, eq + 1, &err)) {
+		fprintf(stderr, "nmimgrctl: '%s': invalid list at '%s'\n",
+			rule, err);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Add the rules of a file: words, up to a # on each line
+ */
+static int compile_file(struct nmimgr_policy *pol, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[4096], *rule, *save;
+	int ret = 0;
+
+	if (!f) {
+		fprintf(stderr, "nmimgrctl: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (!ret && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#")] = '\0';
+		for (rule = strtok_r(line, " \t\r\n", &save); rule && !ret;
+		     rule = strtok_r(NULL, " \t\r\n", &save))
+			ret = compile_rule(pol, rule);
+	}
+	fclose(f);
+	return ret;
+}
+
+static int compile(struct nmimgr_policy *pol, int argc, char **argv)
+{
+	int i;
+
+	nmimgr_policy_init(pol);
+	for (i = 0; i < argc; i++) {
+		if (argv[i][0] == '@' ? compile_file(pol, argv[i] + 1) :
+		    compile_rule(pol, argv[i]))
+			return -1;
+	}
+	return 0;
+}
+
+static int devopen(void)
+{
+	int fd = open(dev, O_RDONLY);
+
+	if (fd < 0)
+		fprintf(stderr, "nmimgrctl: %s: %s\n", dev, strerror(errno));
+	return fd;
+}
+
+/**
+ * Send a command without data, or pol, to the device
+ */
+static int control(const char *name, unsigned long cmd,
+			const struct nmimgr_policy *pol)
+{
+	int fd = devopen();
+	int ret = 0;
+
+	if (fd < 0)
+		return 1;
+
+	if (ioctl(fd, cmd, pol)) {
+		fprintf(stderr, "nmimgrctl: %s: %s\n", name, strerror(errno));
+		ret = 1;
+	}
+	close(fd);
+	return ret;
+}
+
+static int upload(const struct nmimgr_policy *pol)
+{
+	return control("upload", shadow ? NMIMGR_IOC_SET_SHADOW :
+		NMIMGR_IOC_SET_POLICY, pol);
+}
+
+static int cmd_compile(int argc, char **argv)
+{
+	struct nmimgr_policy pol;
+
+	if (compile(&pol, argc, argv))
+		return 1;
+
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "nmimgrctl: not writing a binary policy to a "
+			"terminal\n");
+		return 1;
+	}
+	if (fwrite(&pol, sizeof(pol), 1, stdout) != 1 || fflush(stdout)) {
+		fprintf(stderr, "nmimgrctl: write: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * The decided actions of each event, as the initializer of the module
+ * policy table, and the ops it uses
+ */
+static int cmd_bake(int argc, char **argv)
+{
+	struct nmimgr_policy pol;
+	unsigned int ops = 0;
+	int i, t, r, n;
+	__u8 act;
+
+	if (compile(&pol, argc, argv))
+		return 1;
+
+	printf("/* Generated by nmimgrctl bake, do not edit. Rules:\n");
+	for (i = 0; i < argc; i++)
+		printf(" *   %s\n", argv[i]);
+	printf(" */\n\n");
+
+	for (t = 0; t < NMIMGR_NTYPES; t++)
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			ops |= nmimgr_policy_decide(pol.act[t][r]);
+	printf("#define NMIMGR_BAKED_OPS  0x%02x\n\n", ops);
+
+	printf("#define NMIMGR_BAKED_ACT { \\\n");
+	for (t = 0; t < NMIMGR_NTYPES; t++) {
+		printf("\t[%d] = {  /* %s */ \\\n", t, typenames[t]);
+		for (r = 0, n = 0; r < NMIMGR_NBMAX; r++) {
+			act = nmimgr_policy_decide(pol.act[t][r]);
+			if (!act)
+				continue;
+			printf("%s[0x%02x] = 0x%02x,", n % 4 ? " " : "\t\t", r, act);
+			if (++n % 4 == 0)
+				printf(" \\\n");
+		}
+		if (n % 4)
+			printf(" \\\n");
+		printf("\t}, \\\n");
+	}
+	printf("}\n");
+
+	if (fflush(stdout)) {
+		fprintf(stderr, "nmimgrctl: write: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Read a compiled policy from path, stdin for "-"
+ */
+static int read_policy(const char *path, struct nmimgr_policy *pol)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	size_t len;
+
+	if (!f) {
+		fprintf(stderr, "nmimgrctl: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	/* One policy, and nothing after it */
+	len = fread(pol, 1, sizeof(*pol), f);
+	if (len == sizeof(*pol) && fgetc(f) != EOF)
+		len = 0;
+	if (f != stdin)
+		fclose(f);
+
+	if (len != sizeof(*pol)) {
+		fprintf(stderr, "nmimgrctl: %s: not a policy of %zu bytes\n",
+			path, sizeof(*pol));
+		return 1;
+	}
+
+	if (nmimgr_policy_check(pol)) {
+		fprintf(stderr, "nmimgrctl: %s: bad magic, version or action\n",
+			path);
+		return 1;
+	}
+	return 0;
+}
+
+static int cmd_load(const char *path)
+{
+	struct nmimgr_policy pol;
+
+	if (read_policy(path, &pol))
+		return 1;
+	return upload(&pol);
+}
+
+static int cmd_set(int argc, char **argv)
+{
+	struct nmimgr_policy pol;
+
+	if (compile(&pol, argc, argv))
+		return 1;
+	return upload(&pol);
+}
+
+/**
+ * Print the reasons of act[] with the op bit, as a list
+ */
+static void print_list(const __u8 *act, int op)
+{
+	const char *sep = "";
+	int r, end;
+
+	for (r = 0; r < NMIMGR_NBMAX; r++) {
+		if (!(act[r] & (1 << op)))
+			continue;
+
+		for (end = r; end + 1 < NMIMGR_NBMAX; end++)
+			if (!(act[end + 1] & (1 << op)))
+				break;
+
+		if (end > r)
+			printf("%s%d-%d", sep, r, end);
+		else
+			printf("%s%d", sep, r);
+		sep = ",";
+		r = end;
+	}
+}
+
+/**
+ * Whether all the NMI types have the same reasons for op
+ */
+static int same_types(const struct nmimgr_policy *pol, int op)
+{
+	int r, t;
+
+	for (t = 1; t < NMIMGR_NTYPES; t++)
+		for (r = 0; r < NMIMGR_NBMAX; r++)
+			if ((pol->act[t][r] ^ pol->act[0][r]) & (1 << op))
+				return 0;
+	return 1;
+}
+
+static int has_op(const __u8 *act, int op)
+{
+	int r;
+
+	for (r = 0; r < NMIMGR_NBMAX; r++)
+		if (act[r] & (1 << op))
+			return 1;
+	return 0;
+}
+
+/**
+ * The live or shadow policy, or the compiled one of path if given
+ */
+static int cmd_show(const char *path)
+{
+	struct nmimgr_policy pol;
+	int fd;
+	int op, t;
+
+	if (path) {
+		if (read_policy(path, &pol))
+			return 1;
+	} else {
+		fd = devopen();
+		if (fd < 0)
+			return 1;
+
+		if (ioctl(fd, shadow ? NMIMGR_IOC_GET_SHADOW :
+				NMIMGR_IOC_GET_POLICY, &pol)) {
+			if (shadow && errno == ENOENT)
+				fprintf(stderr, "nmimgrctl: show: no shadow policy\n");
+			else
+				fprintf(stderr, "nmimgrctl: show: %s\n",
+					strerror(errno));
+			close(fd);
+			return 1;
+		}
+		close(fd);
+	}
+
+	/* As rules that "set" takes back */
+	for (op = 0; op < OP_MAX; op++) {
+		if (same_types(&pol, op)) {
+			if (!has_op(pol.act[0], op))
+				continue;
+			printf("%s=", opnames[op]);
+			print_list(pol.act[0], op);
+			printf("\n");
+			continue;
+		}
+
+		for (t = 0; t < NMIMGR_NTYPES; t++) {
+			if (!has_op(pol.act[t], op))
+				continue;
+			printf("%s/%s=", opnames[op], typenames[t]);
+			print_list(pol.act[t], op);
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+static int cmd_stats(void)
+{
+	struct nmimgr_stats st;
+	int fd = devopen();
+	int i, op;
+
+	if (fd < 0)
+		return 1;
+
+	if (ioctl(fd, NMIMGR_IOC_GET_STATS, &st)) {
+		fprintf(stderr, "nmimgrctl: stats: %s\n", strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("seen: %llu\n", (unsigned long long)st.seen);
+	for (i = 0; i < OP_MAX; i++)
+		printf("%s: %llu\n", opnames[i], (unsigned long long)st.ops[i]);
+	printf("unmanaged: %llu\n", (unsigned long long)st.unmanaged);
+	printf("unclaimed: %llu\n", (unsigned long long)st.unclaimed);
+	printf("handler_ns: %llu\n", (unsigned long long)st.handler_ns);
+	for (i = 0; i < OP_MAX; i++)
+		printf("shadow_%s: %llu\n", opnames[i],
+			(unsigned long long)st.shadow_ops[i]);
+
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		if (st.reason[i])
+			printf("reason 0x%02x: %llu\n", i,
+				(unsigned long long)st.reason[i]);
+	}
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		for (op = 0; op < OP_MAX; op++)
+			if (st.shadow_reason[i][op])
+				break;
+		if (op == OP_MAX)
+			continue;
+
+		printf("shadow_reason 0x%02x:", i);
+		for (op = 0; op < OP_MAX; op++)
+			if (st.shadow_reason[i][op])
+				printf(" %s=%llu", opnames[op],
+					(unsigned long long)st.shadow_reason[i][op]);
+		printf("\n");
+	}
+	for (i = 0; i < NMIMGR_NBMAX; i++) {
+		if (st.shadow_diff[i])
+			printf("shadow 0x%02x: %llu\n", i,
+				(unsigned long long)st.shadow_diff[i]);
+	}
+	return 0;
+}
+
+static int cmd_events(void)
+{
+	FILE *f = fopen(NMIMGR_EVENTS, "r");
+	char buf[4096];
+	size_t len;
+
+	if (!f) {
+		fprintf(stderr, "nmimgrctl: %s: %s\n", NMIMGR_EVENTS,
+			strerror(errno));
+		return 1;
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		fwrite(buf, 1, len, stdout);
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *cmd;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+d:hs")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		case 's':
+			shadow = 1;
+			break;
+		default:
+			usage(stderr);
+			return 2;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(stderr);
+		return 2;
+	}
+
+	cmd = argv[optind++];
+	argc -= optind;
+	argv += optind;
+
+	if (!strcmp(cmd, "compile"))
+		return cmd_compile(argc, argv);
+	if (!strcmp(cmd, "bake"))
+		return cmd_bake(argc, argv);
+	if (!strcmp(cmd, "load") && argc == 1)
+		return cmd_load(argv[0]);
+	if (!strcmp(cmd, "set"))
+		return cmd_set(argc, argv);
+	if (!strcmp(cmd, "show") && argc <= 1)
+		return cmd_show(argc ? argv[0] : NULL);
+	if (!strcmp(cmd, "stats"))
+		return cmd_stats();
+	if (!strcmp(cmd, "events"))
+		return cmd_events();
+	if (!strcmp(cmd, "unshadow"))
+		return control(cmd, NMIMGR_IOC_CLEAR_SHADOW, NULL);
+	if (!strcmp(cmd, "promote"))
+		return control(cmd, NMIMGR_IOC_PROMOTE_SHADOW, NULL);
+
+	usage(stderr);
+	return 2;
+}